@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+enum class HugePages {
+    OFF,
+    TRANSPARENT,
+    EXPLICIT
+};
+
+// Bump allocator that hands out cache-line aligned slabs from 2MB-aligned
+// chunks. TRANSPARENT chunks are madvise'd for transparent huge pages;
+// EXPLICIT chunks come from the reserved hugetlb pool and fall back to
+// TRANSPARENT when the pool is empty. A returned slab is handed out again
+// for the next request of the same size from a chunk of the current mode,
+// or rewinds the bump pointer if it was the chunk's last; a chunk is
+// unmapped once every slab carved from it has been returned.
+class HugePageArena {
+  private:
+    struct Chunk {
+        char *base;
+        size_t size;
+        size_t used;
+        size_t liveSlabs;
+        HugePages mode;
+        bool explicitPages;
+        // Returned slabs below used, by size.
+        std::unordered_map<size_t, std::vector<char *>> freeSlabs;
+    };
+
+    std::atomic<HugePages> currentMode{HugePages::OFF};
+    std::mutex mutex;
+    std::vector<Chunk> chunks;
+    size_t chunkSize = size_t(32) << 20;
+    size_t explicitFallbacks = 0;
+
+    HugePageArena() = default;
+
+    static size_t roundUp(size_t n, size_t to) {
+        return (n + to - 1) / to * to;
+    }
+
+    Chunk *mapChunk(size_t minBytes, HugePages mode) {
+        size_t size = roundUp(std::max(minBytes, chunkSize), hugePageSize);
+        char *base = nullptr;
+        bool explicitPages = false;
+
+        if (mode == HugePages::EXPLICIT) {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                base = static_cast<char *>(p);
+                explicitPages = true;
+            } else {
+                explicitFallbacks++;
+            }
+        }
+
+        if (base == nullptr) {
+            // Over-map by one huge page and trim so the chunk starts on a
+            // 2MB boundary, which THP needs to back it with huge pages.
+            size_t mapped = size + hugePageSize;
+            void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                return nullptr;
+            }
+            char *raw = static_cast<char *>(p);
+            char *aligned = reinterpret_cast<char *>(
+                roundUp(reinterpret_cast<uintptr_t>(raw), hugePageSize));
+            if (aligned > raw) {
+                munmap(raw, aligned - raw);
+            }
+            size_t tail = (raw + mapped) - (aligned + size);
+            if (tail > 0) {
+                munmap(aligned + size, tail);
+            }
+            madvise(aligned, size, MADV_HUGEPAGE);
+            base = aligned;
+        }
+
+        chunks.push_back({base, size, 0, 0, mode, explicitPages, {}});
+        return &chunks.back();
+    }
+
+  public:
+    static constexpr size_t hugePageSize = size_t(2) << 20;
+    static constexpr size_t slabAlignment = 64;
+
+    static HugePageArena &instance() {
+        static HugePageArena arena;
+        return arena;
+    }
+
+    HugePageArena(const HugePageArena &) = delete;
+    HugePageArena &operator=(const HugePageArena &) = delete;
+
+    ~HugePageArena() {
+        for (Chunk &chunk : chunks) {
+            munmap(chunk.base, chunk.size);
+        }
+    }
+
+    // Applies to allocations made from now on; existing slabs stay where
+    // they are.
+    void setMode(HugePages mode) { currentMode = mode; }
+
+    HugePages mode() const { return currentMode; }
+
+    bool enabled() const { return currentMode != HugePages::OFF; }
+
+    void setChunkSize(size_t bytes) {
+        chunkSize = roundUp(bytes, hugePageSize);
+    }
+
+    // Returns nullptr when the arena is off or the mapping failed; callers
+    // then fall back to the regular heap.
+    void *allocate(size_t bytes) {
+        HugePages mode = currentMode;
+        if (mode == HugePages::OFF) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes = roundUp(std::max<size_t>(bytes, 1), slabAlignment);
+        for (Chunk &chunk : chunks) {
+            if (chunk.mode != mode) {
+                continue;
+            }
+            auto slabs = chunk.freeSlabs.find(bytes);
+            if (slabs != chunk.freeSlabs.end() && !slabs->second.empty()) {
+                void *p = slabs->second.back();
+                slabs->second.pop_back();
+                chunk.liveSlabs++;
+                return p;
+            }
+        }
+        Chunk *chunk = chunks.empty() ? nullptr : &chunks.back();
+        if (chunk == nullptr || chunk->mode != mode ||
+            chunk->used + bytes > chunk->size) {
+            chunk = mapChunk(bytes, mode);
+            if (chunk == nullptr) {
+                return nullptr;
+            }
+        }
+        void *p = chunk->base + chunk->used;
+        chunk->used += bytes;
+        chunk->liveSlabs++;
+        return p;
+    }
+
+    bool owns(const void *p) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const char *c = static_cast<const char *>(p);
+        for (const Chunk &chunk : chunks) {
+            if (c >= chunk.base && c < chunk.base + chunk.size) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // bytes is the size p was allocated with.
+    void deallocate(void *p, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        char *c = static_cast<char *>(p);
+        bytes = roundUp(std::max<size_t>(bytes, 1), slabAlignment);
+        for (size_t i = 0; i < chunks.size(); i++) {
+            Chunk &chunk = chunks[i];
+            if (c < chunk.base || c >= chunk.base + chunk.size) {
+                continue;
+            }
+            if (--chunk.liveSlabs == 0) {
+                chunk.freeSlabs.clear();
+                if (i + 1 == chunks.size()) {
+                    chunk.used = 0;
+                } else {
+                    munmap(chunk.base, chunk.size);
+                    chunks.erase(chunks.begin() + i);
+                }
+            } else if (c + bytes == chunk.base + chunk.used) {
+                chunk.used -= bytes;
+            } else {
+                chunk.freeSlabs[bytes].push_back(c);
+            }
+            return;
+        }
+    }
+
+    size_t mappedBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = 0;
+        for (const Chunk &chunk : chunks) {
+            total += chunk.size;
+        }
+        return total;
+    }
+
+    size_t explicitPageFallbacks() const { return explicitFallbacks; }
+};
+
+// Counts data-TLB load misses of the calling thread in user space through
+// perf_event_open. available() is false where perf events are not
+// permitted (e.g. in most containers with a strict perf_event_paranoid).
+class TlbMissCounter {
+  private:
+    int fd = -1;
+
+  public:
+    TlbMissCounter() {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~TlbMissCounter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    TlbMissCounter(const TlbMissCounter &) = delete;
+    TlbMissCounter &operator=(const TlbMissCounter &) = delete;
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    // Misses since start(), or -1 when the counter is unavailable.
+    long long stop() {
+        if (fd < 0) {
+            return -1;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        long long count = 0;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            return -1;
+        }
+        return count;
+    }
+};
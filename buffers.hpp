@@ -0,0 +1,174 @@
+#pragma once
+
+#include "arena.hpp"
+#include "numa.hpp"
+#include <Eigen/Dense>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <sys/mman.h>
+
+// A cache-line aligned block of doubles holding parameters, gradients or
+// activations. Blocks come from the huge-page arena while it is enabled and
+// from the regular heap otherwise. A block placed on a NUMA node gets a
+// mapping of its own, bound to the node before its pages are first touched
+// and unmapped with it, so the binding never outlives the block or reaches
+// other allocations.
+class AlignedBuffer {
+  private:
+    double *values = nullptr;
+    size_t count = 0;
+    size_t mappedBytes = 0;
+    bool fromArena = false;
+
+  public:
+    static constexpr size_t alignment = 64;
+
+    // Rounds a view length up so the next view starts on a cache line.
+    static size_t padded(size_t n) {
+        const size_t perLine = alignment / sizeof(double);
+        return (n + perLine - 1) / perLine * perLine;
+    }
+
+    // node < 0 leaves placement to the first thread touching the pages.
+    explicit AlignedBuffer(size_t size, int node = -1) : count(size) {
+        size_t bytes = padded(size > 0 ? size : 1) * sizeof(double);
+        if (node >= 0) {
+            const size_t page = sysconf(_SC_PAGESIZE);
+            size_t length = (bytes + page - 1) / page * page;
+            void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory != MAP_FAILED) {
+                Numa::bindMemory(memory, length, node);
+                values = static_cast<double *>(memory);
+                mappedBytes = length;
+            }
+        }
+        if (values == nullptr) {
+            values = static_cast<double *>(
+                HugePageArena::instance().allocate(bytes));
+            fromArena = values != nullptr;
+        }
+        if (values == nullptr) {
+            values =
+                static_cast<double *>(std::aligned_alloc(alignment, bytes));
+        }
+        if (values == nullptr) {
+            throw std::bad_alloc();
+        }
+        std::memset(values, 0, bytes);
+    }
+
+    ~AlignedBuffer() {
+        if (mappedBytes > 0) {
+            munmap(values, mappedBytes);
+        } else if (fromArena) {
+            HugePageArena::instance().deallocate(
+                values, padded(count > 0 ? count : 1) * sizeof(double));
+        } else {
+            std::free(values);
+        }
+    }
+
+    AlignedBuffer(const AlignedBuffer &) = delete;
+    AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+    double *data() { return values; }
+
+    const double *data() const { return values; }
+
+    size_t size() const { return count; }
+};
+
+// A column-major matrix view over AlignedBuffer storage. resize() keeps the
+// storage while the new shape fits, so per-batch buffers are allocated once;
+// bind() points the view at memory owned by someone else. Copies are deep;
+// moves take the storage, or the binding, and leave the source empty.
+class MatrixBuffer : public Eigen::Map<Eigen::MatrixXd> {
+  private:
+    typedef Eigen::Map<Eigen::MatrixXd> Base;
+    std::unique_ptr<AlignedBuffer> storage;
+    // NUMA node for new storage; copies start unplaced.
+    int node = -1;
+
+    void rebind(double *data, Eigen::Index rows, Eigen::Index cols) {
+        new (static_cast<Base *>(this)) Base(data, rows, cols);
+    }
+
+  public:
+    using Base::operator=;
+
+    MatrixBuffer() : Base(nullptr, 0, 0) {}
+
+    MatrixBuffer(const MatrixBuffer &other) : Base(nullptr, 0, 0) {
+        *this = other;
+    }
+
+    MatrixBuffer &operator=(const MatrixBuffer &other) {
+        if (this != &other) {
+            resize(other.rows(), other.cols());
+            Base::operator=(other);
+        }
+        return *this;
+    }
+
+    MatrixBuffer(MatrixBuffer &&other) noexcept : Base(nullptr, 0, 0) {
+        *this = std::move(other);
+    }
+
+    MatrixBuffer &operator=(MatrixBuffer &&other) noexcept {
+        if (this != &other) {
+            storage = std::move(other.storage);
+            node = other.node;
+            rebind(other.data(), other.rows(), other.cols());
+            other.rebind(nullptr, 0, 0);
+        }
+        return *this;
+    }
+
+    void resize(Eigen::Index rows, Eigen::Index cols) {
+        if (rows == this->rows() && cols == this->cols() && data()) {
+            return;
+        }
+        size_t needed = rows * cols;
+        if (needed == 0) {
+            storage.reset();
+            rebind(nullptr, rows, cols);
+            return;
+        }
+        if (!storage || storage->size() < needed) {
+            storage.reset();
+            storage.reset(new AlignedBuffer(needed, node));
+        }
+        rebind(storage->data(), rows, cols);
+    }
+
+    void bind(double *data, Eigen::Index rows, Eigen::Index cols) {
+        storage.reset();
+        rebind(data, rows, cols);
+    }
+
+    void release() {
+        storage.reset();
+        rebind(nullptr, 0, 0);
+    }
+
+    void setNode(int n) {
+        node = n;
+    }
+
+    // Drops the storage so the next resize() allocates afresh, e.g. after
+    // the huge-page mode changed.
+    void reallocate() {
+        Eigen::Index r = rows();
+        Eigen::Index c = cols();
+        Eigen::MatrixXd saved = *this;
+        release();
+        if (r * c > 0) {
+            resize(r, c);
+            Base::operator=(saved);
+        }
+    }
+};
@@ -0,0 +1,394 @@
+#include "comm.hpp"
+#include "fused.hpp"
+#include "network.hpp"
+#include "packed.hpp"
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Self-checks for the kernels and collectives that have a plain reference:
+// the ring collectives against a serial sum, the packed and fused inference
+// paths against Eigen products, sharded Adam against one unsharded
+// optimizer, and every optimised training path (sparse products, activation
+// stashes, checkpointing, the planned workspace, gradient accumulation and
+// clipping) against plain dense training.
+// Exits non-zero if any check fails; build with -fsanitize=address to also
+// catch reads of freed workspaces.
+
+using namespace Eigen;
+
+static int failures = 0;
+
+static void report(const std::string &name, bool pass,
+                   const std::string &detail) {
+    failures += !pass;
+    std::cout << (pass ? "PASS " : "FAIL ") << std::left << std::setw(36)
+              << name << std::right << " " << detail << "\n";
+}
+
+static void report(const std::string &name, double difference,
+                   double tolerance) {
+    std::ostringstream detail;
+    detail << "max difference " << std::scientific << std::setprecision(2)
+           << difference;
+    report(name, difference <= tolerance, detail.str());
+}
+
+// Element i of rank r's input to the collectives.
+static double rankValue(int r, size_t i) {
+    return std::sin(r * 7.1 + i * 0.37) * (r + 1);
+}
+
+// Chunk c holds 2c + 3 elements, except chunk 1, which is empty.
+static std::vector<size_t> unevenBounds(int ranks) {
+    std::vector<size_t> bounds(ranks + 1, 0);
+    for (int c = 0; c < ranks; c++) {
+        bounds[c + 1] = bounds[c] + (c == 1 ? 0 : 2 * c + 3);
+    }
+    return bounds;
+}
+
+// Each rank checks its own results and fails its exit status on a
+// mismatch, so launch() returns the number of ranks that saw one.
+static void checkCollectives(int ranks, Transport transport) {
+    std::string suffix = " (" + std::to_string(ranks) + " ranks, " +
+                         (transport == Transport::TCP ? "TCP" : "UNIX") +
+                         ")";
+    const double tolerance = 1e-12;
+    std::vector<size_t> bounds = unevenBounds(ranks);
+    const size_t n = bounds.back();
+    std::vector<double> sum(n, 0.0);
+    for (int r = 0; r < ranks; r++) {
+        for (size_t i = 0; i < n; i++) {
+            sum[i] += rankValue(r, i);
+        }
+    }
+
+    std::fflush(nullptr);
+    int failed = RingCommunicator::launch(
+        ranks,
+        [&](RingCommunicator &comm) {
+            const int rank = comm.getRank();
+            std::vector<double> data(n);
+            for (size_t i = 0; i < n; i++) {
+                data[i] = rankValue(rank, i);
+            }
+            comm.reduceScatter(data.data(), bounds);
+            double error = 0.0;
+            for (size_t i = bounds[rank]; i < bounds[rank + 1]; i++) {
+                error = std::max(error, std::abs(data[i] - sum[i]));
+            }
+
+            // Every rank's chunk is its own input, so the gather must
+            // reproduce rankValue(c, i) for chunk c everywhere.
+            std::vector<double> gathered(n, 0.0);
+            for (size_t i = bounds[rank]; i < bounds[rank + 1]; i++) {
+                gathered[i] = rankValue(rank, i);
+            }
+            comm.allGather(gathered.data(), bounds);
+            for (int c = 0; c < ranks; c++) {
+                for (size_t i = bounds[c]; i < bounds[c + 1]; i++) {
+                    error = std::max(error,
+                                     std::abs(gathered[i] - rankValue(c, i)));
+                }
+            }
+
+            // Fewer elements than ranks leaves some chunks empty.
+            for (size_t size : {n, (size_t)ranks - 1, (size_t)1}) {
+                for (size_t i = 0; i < size; i++) {
+                    data[i] = rankValue(rank, i);
+                }
+                comm.allReduce(data.data(), size);
+                for (size_t i = 0; i < size; i++) {
+                    error = std::max(error, std::abs(data[i] - sum[i]));
+                }
+            }
+            return error <= tolerance ? 0 : 1;
+        },
+        transport);
+    report("collectives" + suffix, failed == 0,
+           std::to_string(failed) + " ranks off by more than 1e-12");
+}
+
+static void checkPackedWeights() {
+    double error = 0.0;
+    for (Index inputs : {1, 7, 64, 300}) {
+        for (Index outputs : {1, 10, 33, 256}) {
+            for (Index batch : {1, 5, 64, 700}) {
+                Matrix<double, Dynamic, Dynamic, RowMajor> weights =
+                    MatrixXd::Random(inputs, outputs);
+                MatrixXd input = MatrixXd::Random(inputs, batch);
+                PackedWeights packed;
+                packed.pack(weights);
+                MatrixXd result;
+                packed.multiply(input, result);
+                MatrixXd expected = weights.transpose() * input;
+                error = std::max(error, (result - expected).cwiseAbs()
+                                            .maxCoeff());
+            }
+        }
+    }
+    report("PackedWeights vs Eigen product", error, 1e-12);
+}
+
+static MatrixXd activate(const MatrixXd &z, ActivationType type) {
+    switch (type) {
+    case ActivationType::SIGMOID:
+        return sigmoid(z);
+    case ActivationType::LEAKY_RELU:
+        return leakyRelu(z);
+    case ActivationType::SOFTMAX:
+        return softmax(z);
+    case ActivationType::RELU:
+    default:
+        return relu(z);
+    }
+}
+
+static void checkFusedMLP() {
+    const std::vector<Index> widths = {37, 64, 19, 32, 10};
+    const ActivationType types[] = {
+        ActivationType::RELU, ActivationType::LEAKY_RELU,
+        ActivationType::SIGMOID, ActivationType::SOFTMAX};
+    std::vector<MatrixXd> weights;
+    std::vector<VectorXd> biases;
+    FusedMLP fused;
+    for (size_t l = 0; l + 1 < widths.size(); l++) {
+        weights.push_back(MatrixXd::Random(widths[l], widths[l + 1]) * 0.3);
+        biases.push_back(VectorXd::Random(widths[l + 1]) * 0.1);
+        fused.addLayer(weights[l], biases[l], types[l]);
+    }
+
+    double error = 0.0;
+    for (Index batch : {1, 3, 8, 29}) {
+        MatrixXd x = MatrixXd::Random(widths[0], batch);
+        MatrixXd result = fused.forward(x);
+        for (size_t l = 0; l < weights.size(); l++) {
+            MatrixXd z = weights[l].transpose() * x;
+            z.colwise() += biases[l];
+            x = activate(z, types[l]);
+        }
+        error = std::max(error, (result - x).cwiseAbs().maxCoeff());
+    }
+    report("FusedMLP vs Eigen layers", error, 1e-12);
+}
+
+// The same gradients stepped by one Adam, and by three Adams that each own
+// a third of the parameters (two threads each), must give the same bits.
+static void checkShardedAdam() {
+    Network network(37, 64, ActivationType::RELU);
+    network.addLayer(10, ActivationType::SOFTMAX);
+    const std::vector<double> initial = network.snapshotParameters();
+    const size_t total = network.parameterCount();
+    const int shards = 3;
+    std::vector<MatrixXd> inputs;
+    std::vector<MatrixXd> targets;
+    for (int b = 0; b < 8; b++) {
+        inputs.push_back(MatrixXd::Random(37, 16).cwiseAbs());
+        MatrixXd target = MatrixXd::Zero(10, 16);
+        for (int i = 0; i < 16; i++) {
+            target((b + i) % 10, i) = 1.0;
+        }
+        targets.push_back(target);
+    }
+
+    Adam unsharded(0.01);
+    for (size_t b = 0; b < inputs.size(); b++) {
+        network.forward(inputs[b]);
+        network.computeGradients(inputs[b], targets[b]);
+        network.step(unsharded);
+    }
+    const std::vector<double> expected = network.snapshotParameters();
+
+    network.restoreParameters(initial);
+    std::vector<Adam> sharded;
+    sharded.reserve(shards);
+    for (int s = 0; s < shards; s++) {
+        sharded.emplace_back(0.01);
+        sharded[s].setShard(total * s / shards, total * (s + 1) / shards);
+        sharded[s].setThreads(2);
+    }
+    for (size_t b = 0; b < inputs.size(); b++) {
+        network.forward(inputs[b]);
+        network.computeGradients(inputs[b], targets[b]);
+        VectorXd gradients = network.gradientVector();
+        for (int s = 0; s < shards; s++) {
+            network.gradientVector() = gradients;
+            network.markGradientsAccumulated(s == 0 ? 0 : 1);
+            network.step(sharded[s]);
+        }
+    }
+    const std::vector<double> result = network.snapshotParameters();
+
+    double error = 0.0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        error = std::max(error, std::abs(result[i] - expected[i]));
+    }
+    report("sharded Adam vs unsharded", error, 0.0);
+}
+
+static double maxDifference(const std::vector<double> &a,
+                            const std::vector<double> &b) {
+    double error = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        error = std::max(error, std::abs(a[i] - b[i]));
+    }
+    return error;
+}
+
+typedef std::vector<std::pair<MatrixXd, MatrixXd>> Batches;
+
+// Non-negative inputs with about zeros of them set to 0, and one-hot
+// targets, for each batch size.
+static Batches sampleBatches(Index inputs, Index outputs,
+                             const std::vector<Index> &sizes,
+                             double zeros = 0.0) {
+    Batches batches;
+    for (Index cols : sizes) {
+        MatrixXd input = MatrixXd::Random(inputs, cols).cwiseAbs();
+        MatrixXd mask = (MatrixXd::Random(inputs, cols).array() + 1.0) / 2.0;
+        input = (mask.array() < zeros).select(0.0, input);
+        MatrixXd target = MatrixXd::Zero(outputs, cols);
+        for (Index c = 0; c < cols; c++) {
+            target(c % outputs, c) = 1.0;
+        }
+        batches.emplace_back(input, target);
+    }
+    return batches;
+}
+
+// Trains network (a copy) on batches with SGD and returns its parameters.
+static std::vector<double> trained(Network network, const Batches &batches,
+                                   double lr = 0.05) {
+    SGD sgd(lr);
+    for (const auto &batch : batches) {
+        network.trainBatch(batch.first, batch.second, sgd);
+    }
+    return network.snapshotParameters();
+}
+
+// Training and inference with a planned workspace, at batch sizes that
+// grow and shrink so the workspace is replaced while layers point into it.
+static void checkMemoryPlanning() {
+    Network dense(20, 16, ActivationType::RELU);
+    dense.addLayer(10, ActivationType::SOFTMAX);
+    Network planned = dense;
+    planned.setMemoryPlanning(true);
+    Batches batches = sampleBatches(20, 10, {4, 64, 3, 100, 7});
+    double error = maxDifference(trained(dense, batches),
+                                 trained(planned, batches));
+    for (const auto &batch : batches) {
+        MatrixXd expected = dense.infer(batch.first);
+        MatrixXd result = planned.infer(batch.first);
+        error = std::max(error, (result - expected).cwiseAbs().maxCoeff());
+        dense.forward(batch.first);
+        planned.forward(batch.first);
+        error = std::max(error, (planned.getOutput() - dense.getOutput())
+                                    .cwiseAbs()
+                                    .maxCoeff());
+    }
+    report("planned workspace vs layer buffers", error, 1e-12);
+}
+
+// Each optimised training path against the dense per-layer one it stands
+// in for, trained from the same parameters on the same batches. The
+// reduced-precision stashes feed rounded activations to the weight
+// gradients, so they only stay close.
+static void checkTrainingPaths() {
+    Network dense(30, 24, ActivationType::RELU);
+    dense.addLayer(16, ActivationType::RELU);
+    dense.addLayer(12, ActivationType::LEAKY_RELU);
+    dense.addLayer(10, ActivationType::SOFTMAX);
+    dense.setSparseInputThreshold(0.0);
+    Batches batches = sampleBatches(30, 10, {16, 16, 10, 16, 7}, 0.8);
+    const std::vector<double> expected = trained(dense, batches);
+
+    struct Path {
+        std::string name;
+        std::function<void(Network &)> configure;
+        double tolerance;
+    };
+    const std::vector<Path> paths = {
+        {"sparse input",
+         [](Network &n) { n.setSparseInputThreshold(1.0); }, 1e-12},
+        {"sparse activations",
+         [](Network &n) { n.setActivationSparsity(1.0); }, 1e-12},
+        {"compact stash",
+         [](Network &n) { n.setActivationStash(ActivationStash::COMPACT); },
+         0.0},
+        {"FP16 stash",
+         [](Network &n) { n.setActivationStash(ActivationStash::FP16); },
+         1e-5},
+        {"BF16 stash",
+         [](Network &n) { n.setActivationStash(ActivationStash::BF16); },
+         1e-4},
+        {"checkpoint recomputation",
+         [](Network &n) { n.setCheckpoints({1}); }, 0.0},
+        {"gradient accumulation",
+         [](Network &n) { n.setGradientAccumulation(3); }, 1e-12},
+    };
+    for (const Path &path : paths) {
+        Network network = dense;
+        path.configure(network);
+        report(path.name + " vs dense",
+               maxDifference(trained(network, batches), expected),
+               path.tolerance);
+    }
+}
+
+// Clipping to maxNorm must equal scaling the summed gradients down to
+// maxNorm by hand before an unclipped step.
+static void checkGradientClipping() {
+    Network reference(30, 24, ActivationType::RELU);
+    reference.addLayer(10, ActivationType::SOFTMAX);
+    reference.setSparseInputThreshold(0.0);
+    Network clipped = reference;
+    const double maxNorm = 0.05;
+    clipped.setGradientClipping(maxNorm);
+    Batches batches = sampleBatches(30, 10, {16, 16, 10, 16, 7});
+    SGD sgd(0.05);
+    long scaled = 0;
+    for (const auto &batch : batches) {
+        reference.forward(batch.first);
+        reference.computeGradients(batch.first, batch.second);
+        Map<VectorXd> gradients = reference.gradientVector();
+        double norm = gradients.norm();
+        if (norm > maxNorm) {
+            gradients *= maxNorm / norm;
+            scaled++;
+        }
+        reference.step(sgd);
+        clipped.trainBatch(batch.first, batch.second, sgd);
+    }
+    double error = maxDifference(clipped.snapshotParameters(),
+                                 reference.snapshotParameters());
+    report("gradient clipping vs scaled step", error, 1e-15);
+    report("clipped steps", clipped.getClippedSteps() == scaled,
+           std::to_string(clipped.getClippedSteps()) + " of " +
+               std::to_string(scaled) + " expected");
+}
+
+int main() {
+    std::cout << "\n===== CHECKS =====\n";
+    for (int ranks : {2, 3, 4}) {
+        checkCollectives(ranks, Transport::UNIX);
+    }
+    checkCollectives(3, Transport::TCP);
+    checkPackedWeights();
+    checkFusedMLP();
+    checkShardedAdam();
+    checkMemoryPlanning();
+    checkTrainingPaths();
+    checkGradientClipping();
+    std::cout << "==================\n"
+              << (failures == 0 ? "All checks passed"
+                                : std::to_string(failures) +
+                                      " check(s) failed")
+              << "\n\n";
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,478 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Transport between ranks on one host: Unix-domain sockets in a shared
+// directory, or TCP on the loopback interface.
+enum class Transport {
+    UNIX,
+    TCP
+};
+
+// Stream sockets between processes on this host. Endpoint i of a
+// rendezvous address is the socket file address/endpoint-i.sock for UNIX
+// and loopback port address + i for TCP.
+class LocalSocket {
+  public:
+    static void fail(const std::string &what) {
+        throw std::runtime_error(what + ": " + std::strerror(errno));
+    }
+
+    static std::string path(const std::string &address, int endpoint) {
+        return address + "/endpoint-" + std::to_string(endpoint) + ".sock";
+    }
+
+    // A fresh socket directory for UNIX, or a base port derived from the
+    // process id for TCP.
+    static std::string newRendezvous(Transport transport) {
+        if (transport == Transport::TCP) {
+            return std::to_string(20000 + getpid() % 20000);
+        }
+        char dir[] = "/tmp/nn-sockets-XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            fail("mkdtemp");
+        }
+        return dir;
+    }
+
+    static void removeRendezvous(Transport transport,
+                                 const std::string &address) {
+        if (transport == Transport::UNIX) {
+            rmdir(address.c_str());
+        }
+    }
+
+    static int listenOn(Transport transport, const std::string &address,
+                        int endpoint, int backlog = 1) {
+        int fd;
+        if (transport == Transport::UNIX) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            std::string file = path(address, endpoint);
+            std::strncpy(addr.sun_path, file.c_str(),
+                         sizeof(addr.sun_path) - 1);
+            unlink(file.c_str());
+            if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+                fail("bind " + file);
+            }
+        } else {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(std::stoi(address) + endpoint);
+            if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+                fail("bind port " +
+                     std::to_string(std::stoi(address) + endpoint));
+            }
+        }
+        if (listen(fd, backlog) != 0) {
+            fail("listen");
+        }
+        return fd;
+    }
+
+    // Retries until the endpoint listens, so processes may start in any
+    // order.
+    static int connectTo(Transport transport, const std::string &address,
+                         int endpoint) {
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        while (true) {
+            int fd;
+            int result;
+            if (transport == Transport::UNIX) {
+                fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                sockaddr_un addr = {};
+                addr.sun_family = AF_UNIX;
+                std::strncpy(addr.sun_path, path(address, endpoint).c_str(),
+                             sizeof(addr.sun_path) - 1);
+                result = connect(fd, (sockaddr *)&addr, sizeof(addr));
+            } else {
+                fd = socket(AF_INET, SOCK_STREAM, 0);
+                sockaddr_in addr = {};
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                addr.sin_port = htons(std::stoi(address) + endpoint);
+                result = connect(fd, (sockaddr *)&addr, sizeof(addr));
+            }
+            if (result == 0) {
+                return fd;
+            }
+            close(fd);
+            if (std::chrono::steady_clock::now() > deadline) {
+                fail("connect to endpoint " + std::to_string(endpoint));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+
+    // Large buffers, no Nagle delay, and non-blocking I/O.
+    static void configure(int fd, Transport transport) {
+        if (transport == Transport::TCP) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        int buffer = 4 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    // Blocking transfers on a non-blocking socket.
+    static void sendAll(int fd, const void *buffer, size_t bytes) {
+        const char *out = static_cast<const char *>(buffer);
+        while (bytes > 0) {
+            ssize_t n = send(fd, out, bytes, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    fail("send");
+                }
+                pollfd p = {fd, POLLOUT, 0};
+                poll(&p, 1, -1);
+                continue;
+            }
+            out += n;
+            bytes -= n;
+        }
+    }
+
+    static void recvAll(int fd, void *buffer, size_t bytes) {
+        char *in = static_cast<char *>(buffer);
+        while (bytes > 0) {
+            ssize_t n = recv(fd, in, bytes, 0);
+            if (n == 0) {
+                errno = ECONNRESET;
+                fail("recv");
+            }
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    fail("recv");
+                }
+                pollfd p = {fd, POLLIN, 0};
+                poll(&p, 1, -1);
+                continue;
+            }
+            in += n;
+            bytes -= n;
+        }
+    }
+};
+
+// A process's place in a ring of size ranks. Rank r keeps one connection to
+// rank r + 1 and one from rank r - 1; allReduce() is the bandwidth-optimal
+// ring algorithm (reduce-scatter, then all-gather), which sends
+// 2 (size - 1) / size of the vector per rank whatever the rank count.
+class RingCommunicator {
+  private:
+    int rank;
+    int ranks;
+    Transport transport;
+    std::string address;
+    int listenFd = -1;
+    int nextFd = -1;
+    int previousFd = -1;
+    std::vector<double> scratch;
+    size_t sentBytes = 0;
+    double waitSeconds = 0.0;
+
+    static void fail(const std::string &what) {
+        LocalSocket::fail("RingCommunicator: " + what);
+    }
+
+    int chunk(int c) const {
+        return (c % ranks + ranks) % ranks;
+    }
+
+    static std::vector<size_t> split(size_t n, int parts) {
+        std::vector<size_t> bounds(parts + 1);
+        for (int p = 0; p <= parts; p++) {
+            bounds[p] = n * p / parts;
+        }
+        return bounds;
+    }
+
+  public:
+    // address is the rendezvous directory for UNIX and the base port for
+    // TCP (rank r listens on base + r).
+    RingCommunicator(int rank, int ranks, const std::string &address,
+                     Transport transport = Transport::UNIX)
+        : rank(rank), ranks(ranks), transport(transport), address(address) {
+        if (ranks == 1) {
+            return;
+        }
+        listenFd = LocalSocket::listenOn(transport, address, rank);
+        nextFd =
+            LocalSocket::connectTo(transport, address, (rank + 1) % ranks);
+        previousFd = accept(listenFd, nullptr, nullptr);
+        if (previousFd < 0) {
+            fail("accept");
+        }
+        LocalSocket::configure(nextFd, transport);
+        LocalSocket::configure(previousFd, transport);
+    }
+
+    ~RingCommunicator() {
+        for (int fd : {nextFd, previousFd, listenFd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (listenFd >= 0 && transport == Transport::UNIX) {
+            unlink(LocalSocket::path(address, rank).c_str());
+        }
+    }
+
+    RingCommunicator(const RingCommunicator &) = delete;
+    RingCommunicator &operator=(const RingCommunicator &) = delete;
+
+    // From NN_RANK, NN_RANKS and NN_RENDEZVOUS (a directory, or a base port
+    // with NN_TRANSPORT=tcp), for ranks started by an outside launcher.
+    static std::unique_ptr<RingCommunicator> fromEnvironment() {
+        const char *rank = std::getenv("NN_RANK");
+        const char *ranks = std::getenv("NN_RANKS");
+        const char *rendezvous = std::getenv("NN_RENDEZVOUS");
+        const char *transport = std::getenv("NN_TRANSPORT");
+        if (rank == nullptr || ranks == nullptr || rendezvous == nullptr) {
+            return nullptr;
+        }
+        Transport t = transport != nullptr && std::string(transport) == "tcp"
+                          ? Transport::TCP
+                          : Transport::UNIX;
+        return std::unique_ptr<RingCommunicator>(new RingCommunicator(
+            std::atoi(rank), std::atoi(ranks), rendezvous, t));
+    }
+
+    // Forks ranks processes on this host, connects them into a ring and runs
+    // fn(communicator) in each; fn's return value is the exit status.
+    // Returns 0 when every rank exited with 0.
+    static int launch(int ranks,
+                      const std::function<int(RingCommunicator &)> &fn,
+                      Transport transport = Transport::UNIX) {
+        std::string address = LocalSocket::newRendezvous(transport);
+
+        std::fflush(nullptr);
+        std::vector<pid_t> children;
+        for (int r = 0; r < ranks; r++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                fail("fork");
+            }
+            if (pid == 0) {
+                int status = 1;
+                try {
+                    RingCommunicator communicator(r, ranks, address,
+                                                  transport);
+                    status = fn(communicator);
+                } catch (const std::exception &e) {
+                    std::fprintf(stderr, "rank %d: %s\n", r, e.what());
+                }
+                std::fflush(nullptr);
+                _exit(status);
+            }
+            children.push_back(pid);
+        }
+
+        int failed = 0;
+        for (pid_t pid : children) {
+            int status = 0;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                failed++;
+            }
+        }
+        LocalSocket::removeRendezvous(transport, address);
+        return failed;
+    }
+
+    int getRank() const {
+        return rank;
+    }
+
+    int size() const {
+        return ranks;
+    }
+
+    size_t bytesSent() const {
+        return sentBytes;
+    }
+
+    // Time spent blocked on the sockets.
+    double communicationSeconds() const {
+        return waitSeconds;
+    }
+
+    // Sends sendBytes to the next rank while receiving recvBytes from the
+    // previous one, so neither side blocks on a full socket buffer.
+    void exchange(const void *sendBuffer, size_t sendBytes, void *recvBuffer,
+                  size_t recvBytes) {
+        auto start = std::chrono::steady_clock::now();
+        const char *out = static_cast<const char *>(sendBuffer);
+        char *in = static_cast<char *>(recvBuffer);
+        size_t sent = 0;
+        size_t received = 0;
+        while (sent < sendBytes || received < recvBytes) {
+            pollfd fds[2];
+            int count = 0;
+            if (sent < sendBytes) {
+                fds[count++] = {nextFd, POLLOUT, 0};
+            }
+            if (received < recvBytes) {
+                fds[count++] = {previousFd, POLLIN, 0};
+            }
+            if (poll(fds, count, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail("poll");
+            }
+            for (int i = 0; i < count; i++) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+                if (fds[i].fd == nextFd) {
+                    ssize_t n = send(nextFd, out + sent, sendBytes - sent,
+                                     MSG_NOSIGNAL);
+                    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                        fail("send");
+                    }
+                    sent += std::max<ssize_t>(n, 0);
+                } else {
+                    ssize_t n =
+                        recv(previousFd, in + received, recvBytes - received, 0);
+                    if (n == 0) {
+                        errno = ECONNRESET;
+                        fail("recv");
+                    }
+                    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                        fail("recv");
+                    }
+                    received += std::max<ssize_t>(n, 0);
+                }
+            }
+        }
+        sentBytes += sendBytes;
+        waitSeconds += std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    }
+
+    // Chunk r of data (bounds[r] to bounds[r + 1], ranks + 1 bounds) ends
+    // up on rank r as its elementwise sum over all ranks; the other chunks
+    // are left holding partial sums. Each chunk is summed in one fixed
+    // order around the ring.
+    void reduceScatter(double *data, const std::vector<size_t> &bounds) {
+        if (ranks == 1) {
+            return;
+        }
+        size_t largest = 0;
+        for (int c = 0; c < ranks; c++) {
+            largest = std::max(largest, bounds[c + 1] - bounds[c]);
+        }
+        scratch.resize(largest);
+        for (int k = 0; k < ranks - 1; k++) {
+            int s = chunk(rank - k - 1);
+            int r = chunk(rank - k - 2);
+            size_t length = bounds[r + 1] - bounds[r];
+            exchange(data + bounds[s],
+                     (bounds[s + 1] - bounds[s]) * sizeof(double),
+                     scratch.data(), length * sizeof(double));
+            Eigen::Map<Eigen::VectorXd>(data + bounds[r], length) +=
+                Eigen::Map<Eigen::VectorXd>(scratch.data(), length);
+        }
+    }
+
+    // Copies chunk r of data from rank r to every rank.
+    void allGather(double *data, const std::vector<size_t> &bounds) {
+        for (int k = 0; k < ranks - 1; k++) {
+            int s = chunk(rank - k);
+            int r = chunk(rank - k - 1);
+            exchange(data + bounds[s],
+                     (bounds[s + 1] - bounds[s]) * sizeof(double),
+                     data + bounds[r],
+                     (bounds[r + 1] - bounds[r]) * sizeof(double));
+        }
+    }
+
+    // Replaces data on every rank with the elementwise sum over all ranks:
+    // a reduce-scatter, then an all-gather of the summed chunks, so all
+    // ranks end with the same bits.
+    void allReduce(double *data, size_t n) {
+        if (ranks == 1 || n == 0) {
+            return;
+        }
+        std::vector<size_t> bounds = split(n, ranks);
+        reduceScatter(data, bounds);
+        allGather(data, bounds);
+    }
+
+    // Every rank's bytes, indexed by rank. Blocks may differ in size; each
+    // travels size - 1 hops around the ring.
+    std::vector<std::vector<char>> allGather(const std::vector<char> &mine) {
+        std::vector<std::vector<char>> blocks(ranks);
+        blocks[rank] = mine;
+        for (int k = 0; k < ranks - 1; k++) {
+            const std::vector<char> &out = blocks[(rank - k + ranks) % ranks];
+            std::vector<char> &in = blocks[(rank - k - 1 + ranks) % ranks];
+            uint64_t outSize = out.size();
+            uint64_t inSize = 0;
+            exchange(&outSize, sizeof(outSize), &inSize, sizeof(inSize));
+            in.resize(inSize);
+            exchange(out.data(), out.size(), in.data(), in.size());
+        }
+        return blocks;
+    }
+
+    double allReduce(double value) {
+        allReduce(&value, 1);
+        return value;
+    }
+
+    // Copies root's data to every rank, pipelined around the ring in
+    // blocks.
+    void broadcast(double *data, size_t n, int root = 0) {
+        if (ranks == 1) {
+            return;
+        }
+        const size_t block = 1 << 16;
+        bool forward = (rank + 1) % ranks != root;
+        for (size_t begin = 0; begin < n; begin += block) {
+            size_t length = std::min(block, n - begin);
+            if (rank != root) {
+                exchange(nullptr, 0, data + begin, length * sizeof(double));
+            }
+            if (forward) {
+                exchange(data + begin, length * sizeof(double), nullptr, 0);
+            }
+        }
+    }
+
+    void barrier() {
+        allReduce(0.0);
+    }
+};
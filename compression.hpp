@@ -0,0 +1,239 @@
+#pragma once
+
+#include "comm.hpp"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace Eigen;
+
+// Sums one gradient tensor over all ranks in a lossy, smaller encoding.
+// With error feedback, whatever the encoding dropped on this rank is kept
+// as a residual per tensor and added to the tensor's next gradient, so no
+// gradient is lost, only delayed. Every rank decodes the same messages in
+// rank order and ends with the same bits.
+class GradientCompressor {
+  private:
+    std::map<int, VectorXd> residuals;
+
+  protected:
+    // This step's gradient plus the carried residual, written back into g.
+    VectorXd &addResidual(int tensor, double *g, size_t n) {
+        VectorXd &residual = residuals[tensor];
+        if (residual.size() != (Index)n) {
+            residual.setZero(n);
+        }
+        Map<VectorXd> gradient(g, n);
+        gradient += residual;
+        return residual;
+    }
+
+    template <typename T>
+    static void append(std::vector<char> &out, const T &value) {
+        const char *bytes = reinterpret_cast<const char *>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <typename T>
+    static T read(const std::vector<char> &in, size_t &at) {
+        T value;
+        std::memcpy(&value, in.data() + at, sizeof(T));
+        at += sizeof(T);
+        return value;
+    }
+
+  public:
+    virtual ~GradientCompressor() = default;
+
+    virtual std::string name() const = 0;
+
+    // Replaces the rows x cols row-major tensor g with its sum over ranks.
+    // tensor identifies it across steps for the residual.
+    virtual void reduce(int tensor, double *g, Index rows, Index cols,
+                        RingCommunicator &communicator) = 0;
+};
+
+// Sends only the fraction of entries with the largest magnitude, as
+// (index, float value) pairs.
+class TopKCompressor : public GradientCompressor {
+  private:
+    double fraction;
+
+  public:
+    explicit TopKCompressor(double fraction = 0.01) : fraction(fraction) {}
+
+    std::string name() const override {
+        return "Top-k " + std::to_string(fraction * 100.0).substr(0, 4) + "%";
+    }
+
+    void reduce(int tensor, double *g, Index rows, Index cols,
+                RingCommunicator &communicator) override {
+        size_t n = rows * cols;
+        VectorXd &residual = addResidual(tensor, g, n);
+        size_t k = std::max<size_t>(1, std::ceil(fraction * n));
+        std::vector<uint32_t> order(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        std::nth_element(order.begin(), order.begin() + (k - 1), order.end(),
+                         [&](uint32_t a, uint32_t b) {
+                             return std::abs(g[a]) > std::abs(g[b]);
+                         });
+
+        std::vector<char> message;
+        message.reserve(k * (sizeof(uint32_t) + sizeof(float)));
+        Map<VectorXd>(residual.data(), n) = Map<VectorXd>(g, n);
+        for (size_t i = 0; i < k; i++) {
+            float value = g[order[i]];
+            append(message, order[i]);
+            append(message, value);
+            residual(order[i]) -= value;
+        }
+
+        std::fill(g, g + n, 0.0);
+        for (const std::vector<char> &block : communicator.allGather(message)) {
+            size_t at = 0;
+            while (at < block.size()) {
+                uint32_t index = read<uint32_t>(block, at);
+                g[index] += read<float>(block, at);
+            }
+        }
+    }
+};
+
+// Rounds every entry to a signed 8- or 4-bit level of its block's largest
+// magnitude (one float scale per 256 entries).
+class QuantizingCompressor : public GradientCompressor {
+  private:
+    static const size_t block = 256;
+    int bits;
+
+    int levels() const {
+        return (1 << (bits - 1)) - 1;
+    }
+
+  public:
+    explicit QuantizingCompressor(int bits = 8) : bits(bits == 4 ? 4 : 8) {}
+
+    std::string name() const override {
+        return std::to_string(bits) + "-bit quantization";
+    }
+
+    void reduce(int tensor, double *g, Index rows, Index cols,
+                RingCommunicator &communicator) override {
+        size_t n = rows * cols;
+        VectorXd &residual = addResidual(tensor, g, n);
+        const int top = levels();
+        std::vector<char> message;
+        for (size_t begin = 0; begin < n; begin += block) {
+            size_t end = std::min(n, begin + block);
+            double largest = 0.0;
+            for (size_t i = begin; i < end; i++) {
+                largest = std::max(largest, std::abs(g[i]));
+            }
+            float scale = largest / top;
+            append(message, scale);
+            uint8_t packed = 0;
+            for (size_t i = begin; i < end; i++) {
+                int q = scale > 0.0f ? (int)std::lround(g[i] / scale) : 0;
+                residual(i) = g[i] - q * (double)scale;
+                if (bits == 8) {
+                    append(message, (int8_t)q);
+                } else if ((i - begin) % 2 == 0) {
+                    packed = q + 8;
+                } else {
+                    append(message, (uint8_t)(packed | (q + 8) << 4));
+                }
+            }
+            if (bits == 4 && (end - begin) % 2 == 1) {
+                append(message, packed);
+            }
+        }
+
+        std::fill(g, g + n, 0.0);
+        for (const std::vector<char> &in : communicator.allGather(message)) {
+            size_t at = 0;
+            for (size_t begin = 0; begin < n; begin += block) {
+                size_t end = std::min(n, begin + block);
+                double scale = read<float>(in, at);
+                uint8_t packed = 0;
+                for (size_t i = begin; i < end; i++) {
+                    int q;
+                    if (bits == 8) {
+                        q = read<int8_t>(in, at);
+                    } else if ((i - begin) % 2 == 0) {
+                        packed = read<uint8_t>(in, at);
+                        q = (packed & 15) - 8;
+                    } else {
+                        q = (packed >> 4) - 8;
+                    }
+                    g[i] += q * scale;
+                }
+            }
+        }
+    }
+};
+
+// PowerSGD: one power iteration approximates the rows x cols gradient M as
+// P * Q^T of the given rank, so only (rows + cols) * rank values are
+// all-reduced. Q is kept from the previous step as a warm start. Vectors
+// and matrices too small to gain are all-reduced densely.
+class PowerSGDCompressor : public GradientCompressor {
+  private:
+    int rank;
+    std::map<int, MatrixXd> warmStarts;
+
+    static void orthonormalize(MatrixXd &p) {
+        for (Index j = 0; j < p.cols(); j++) {
+            for (Index i = 0; i < j; i++) {
+                p.col(j) -= p.col(i).dot(p.col(j)) * p.col(i);
+            }
+            double norm = p.col(j).norm();
+            p.col(j) /= norm > 1e-12 ? norm : 1.0;
+        }
+    }
+
+  public:
+    explicit PowerSGDCompressor(int rank = 4) : rank(rank) {}
+
+    std::string name() const override {
+        return "PowerSGD rank " + std::to_string(rank);
+    }
+
+    void reduce(int tensor, double *g, Index rows, Index cols,
+                RingCommunicator &communicator) override {
+        if ((rows + cols) * rank >= rows * cols) {
+            communicator.allReduce(g, rows * cols);
+            return;
+        }
+        VectorXd &residual = addResidual(tensor, g, rows * cols);
+        Map<Matrix<double, Dynamic, Dynamic, RowMajor>> m(g, rows, cols);
+
+        MatrixXd &q = warmStarts[tensor];
+        if (q.rows() != cols) {
+            // The same seed on every rank gives the same start.
+            std::mt19937 rng(tensor);
+            std::normal_distribution<double> normal;
+            q.resize(cols, rank);
+            for (Index i = 0; i < q.size(); i++) {
+                q(i) = normal(rng);
+            }
+        }
+
+        MatrixXd p = m * q;
+        communicator.allReduce(p.data(), p.size());
+        orthonormalize(p);
+        q.noalias() = m.transpose() * p;
+        Map<Matrix<double, Dynamic, Dynamic, RowMajor>> kept(residual.data(),
+                                                             rows, cols);
+        kept = m - p * q.transpose();
+        communicator.allReduce(q.data(), q.size());
+        m.noalias() = p * q.transpose();
+    }
+};
@@ -1,4 +1,8 @@
+#pragma once
+
+#include "numa.hpp"
 #include <Eigen/Dense>
+#include <algorithm>
 #include <fstream>
 #include <netinet/in.h>
 #include <string>
@@ -112,4 +116,35 @@ void read_mnist_test_label(const std::string &path,
             data.push_back(vec);
         }
     }
-}
\ No newline at end of file
+}
+
+// Splits data into contiguous shards for shards worker threads. Shard s is
+// copied by a thread bound to Numa::nodeForThread(s), so its samples are
+// first touched on the node of the worker that will read them.
+std::vector<std::vector<Eigen::VectorXd>>
+shard_dataset(const std::vector<Eigen::VectorXd> &data, int shards) {
+    std::vector<std::vector<Eigen::VectorXd>> result(shards);
+    size_t perShard = (data.size() + shards - 1) / shards;
+    for (int s = 0; s < shards; s++) {
+        size_t begin = std::min(data.size(), s * perShard);
+        size_t end = std::min(data.size(), begin + perShard);
+        Numa::runOnNode(Numa::nodeForThread(s), [&]() {
+            result[s].reserve(end - begin);
+            for (size_t i = begin; i < end; i++) {
+                result[s].push_back(data[i]);
+            }
+        });
+    }
+    return result;
+}
+
+// The contiguous part of data that rank reads out of ranks. Every rank
+// gets data.size() / ranks samples, dropping the remainder, so all ranks
+// run the same number of steps per epoch.
+std::vector<Eigen::VectorXd>
+shard_for_rank(const std::vector<Eigen::VectorXd> &data, int rank,
+               int ranks) {
+    size_t perRank = data.size() / ranks;
+    return std::vector<Eigen::VectorXd>(data.begin() + rank * perRank,
+                                        data.begin() + (rank + 1) * perRank);
+}
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "comm.hpp"
+#include "compression.hpp"
+#include "data.hpp"
+#include "network.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Synchronous data-parallel training across processes. Every rank trains a
+// full copy of the network on its own shard of the data; after each batch
+// the gradients are summed with a ring all-reduce, so all ranks take the
+// same step and their parameters stay bit-identical.
+//
+// The gradient buffer is cut into buckets of whole layers, filled from the
+// last layer down. A bucket is handed to a communication thread as soon as
+// backward has written its lowest layer, so its all-reduce overlaps with
+// the backward pass of the layers below; only what is still in flight when
+// backward ends is exposed.
+class DistributedTrainer {
+  private:
+    struct Bucket {
+        size_t begin;
+        size_t size;
+        // Layers [firstLayer, endLayer) in the bucket.
+        size_t firstLayer;
+        size_t endLayer;
+    };
+
+    Network &network;
+    RingCommunicator &communicator;
+    GradientCompressor *compressor = nullptr;
+    size_t bucketBytes = 1 << 20;
+    std::vector<size_t> layerOffsets;
+    std::vector<Bucket> buckets;
+    // Bucket completed by each layer's gradients, or -1.
+    std::vector<int> bucketOfLayer;
+
+    std::thread sender;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable reduced;
+    std::vector<int> queue;
+    size_t doneBuckets = 0;
+    bool stopping = false;
+    double reduceSeconds = 0.0;
+    double exposedSeconds = 0.0;
+
+    void planBuckets() {
+        std::vector<size_t> &offsets = layerOffsets;
+        offsets.clear();
+        size_t offset = 0;
+        for (size_t i = 0; i < network.layerCount(); i++) {
+            offsets.push_back(offset);
+            offset += Layer::parameterCount(network.getLayer(i).inputs(),
+                                            network.getLayer(i).outputs());
+        }
+        buckets.clear();
+        bucketOfLayer.assign(network.layerCount(), -1);
+        size_t end = offset;
+        size_t endLayer = network.layerCount();
+        for (int i = network.layerCount() - 1; i >= 0; i--) {
+            bool full = (end - offsets[i]) * sizeof(double) >= bucketBytes;
+            if (full || i == 0) {
+                buckets.push_back(
+                    {offsets[i], end - offsets[i], (size_t)i, endLayer});
+                bucketOfLayer[i] = buckets.size() - 1;
+                end = offsets[i];
+                endLayer = i;
+            }
+        }
+    }
+
+    void senderLoop() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [&]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            int b = queue.front();
+            queue.erase(queue.begin());
+            lock.unlock();
+
+            // Looked up per bucket: setHugePages() or detachParameters()
+            // may have replaced the buffer since the last step.
+            Map<VectorXd> gradients = network.gradientVector();
+            auto start = std::chrono::steady_clock::now();
+            if (compressor == nullptr) {
+                communicator.allReduce(gradients.data() + buckets[b].begin,
+                                       buckets[b].size);
+            } else {
+                for (size_t l = buckets[b].firstLayer; l < buckets[b].endLayer;
+                     l++) {
+                    reduceCompressed(gradients.data() + layerOffsets[l], l);
+                }
+            }
+            double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+            lock.lock();
+            reduceSeconds += seconds;
+            doneBuckets++;
+            reduced.notify_one();
+        }
+    }
+
+    // Weight gradient and bias gradient of layer l as separate tensors.
+    void reduceCompressed(double *gradients, size_t l) {
+        Index in = network.getLayer(l).inputs();
+        Index out = network.getLayer(l).outputs();
+        compressor->reduce(2 * l, gradients, in, out, communicator);
+        compressor->reduce(2 * l + 1,
+                           gradients + AlignedBuffer::padded(in * out), out, 1,
+                           communicator);
+    }
+
+    void enqueue(size_t layer) {
+        int b = bucketOfLayer[layer];
+        if (b < 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(b);
+        }
+        queued.notify_one();
+    }
+
+  public:
+    // Starts every rank from rank 0's parameters, whatever each rank's own
+    // initialization was.
+    DistributedTrainer(Network &network, RingCommunicator &communicator)
+        : network(network), communicator(communicator) {
+        broadcastParameters();
+        planBuckets();
+        if (communicator.size() > 1) {
+            sender = std::thread(&DistributedTrainer::senderLoop, this);
+        }
+    }
+
+    ~DistributedTrainer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_one();
+        if (sender.joinable()) {
+            sender.join();
+        }
+    }
+
+    DistributedTrainer(const DistributedTrainer &) = delete;
+    DistributedTrainer &operator=(const DistributedTrainer &) = delete;
+
+    // Sums gradients in compressor's encoding (nullptr for exact doubles).
+    // Must be the same kind of compressor on every rank.
+    void setCompressor(GradientCompressor *c) {
+        compressor = c;
+    }
+
+    // 0 puts the whole gradient in one bucket, reduced after backward.
+    void setBucketBytes(size_t bytes) {
+        bucketBytes = bytes > 0 ? bytes : SIZE_MAX;
+        planBuckets();
+    }
+
+    size_t getBucketBytes() const {
+        return bucketBytes;
+    }
+
+    size_t bucketCount() const {
+        return buckets.size();
+    }
+
+    // Time the communication thread spent in all-reduce, and the part of it
+    // the training thread waited for after backward.
+    double allReduceSeconds() const {
+        return reduceSeconds;
+    }
+
+    double exposedCommunicationSeconds() const {
+        return exposedSeconds;
+    }
+
+    double hiddenCommunicationSeconds() const {
+        return std::max(0.0, reduceSeconds - exposedSeconds);
+    }
+
+    // Runs steps batches per candidate bucket size (0 = one bucket) and
+    // keeps the fastest. The summed gradients are discarded without a step,
+    // so neither the parameters nor the clipping statistics change; all
+    // ranks average their timings and pick the same size.
+    size_t tuneBucketSize(const MatrixXd &batchInput,
+                          const MatrixXd &batchTarget, int steps = 5,
+                          std::vector<size_t> candidates = {
+                              64 << 10, 256 << 10, 1 << 20, 4 << 20, 0}) {
+        typedef std::chrono::steady_clock Clock;
+        const bool report = communicator.getRank() == 0;
+        if (report) {
+            std::cout << "\n===== GRADIENT BUCKET TUNING (" << steps
+                      << " steps each) =====\n";
+        }
+        size_t best = bucketBytes;
+        double bestSeconds = 0.0;
+        for (size_t bytes : candidates) {
+            setBucketBytes(bytes);
+            reduceGradients(batchInput, batchTarget);
+            network.discardGradients();
+            double reduceBefore = reduceSeconds;
+            double exposedBefore = exposedSeconds;
+            auto start = Clock::now();
+            for (int s = 0; s < steps; s++) {
+                reduceGradients(batchInput, batchTarget);
+                network.discardGradients();
+            }
+            double seconds =
+                std::chrono::duration<double>(Clock::now() - start).count();
+            seconds = communicator.allReduce(seconds) / communicator.size();
+            double reduce = reduceSeconds - reduceBefore;
+            double hidden = reduce - (exposedSeconds - exposedBefore);
+            if (report) {
+                std::cout << std::setw(8)
+                          << (bytes > 0 ? std::to_string(bytes >> 10) + " KiB"
+                                        : std::string("all"))
+                          << ": " << buckets.size() << " buckets, "
+                          << std::fixed << std::setprecision(2)
+                          << seconds / steps * 1000.0 << " ms/step, "
+                          << std::setprecision(1)
+                          << (reduce > 0.0 ? hidden / reduce * 100.0 : 0.0)
+                          << "% of all-reduce hidden\n";
+            }
+            if (bestSeconds == 0.0 || seconds < bestSeconds) {
+                best = bytes;
+                bestSeconds = seconds;
+            }
+        }
+        setBucketBytes(best);
+        if (report) {
+            std::cout << "=======================================\n\n";
+        }
+        return best;
+    }
+
+    void broadcastParameters(int root = 0) {
+        std::vector<double> parameters = network.snapshotParameters();
+        communicator.broadcast(parameters.data(), parameters.size(), root);
+        network.restoreParameters(parameters);
+    }
+
+    // Forward and gradients on this rank's batch, summed over all ranks
+    // into the gradient buffers. Returns the local loss.
+    double reduceGradients(const MatrixXd &batchInput,
+                           const MatrixXd &batchTarget) {
+        network.forward(batchInput);
+        double loss = MSE(batchTarget, network.getOutput());
+        if (communicator.size() > 1) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                doneBuckets = 0;
+            }
+            network.setGradientHook([this](size_t i) { enqueue(i); });
+            network.computeGradients(batchInput, batchTarget);
+            network.setGradientHook(nullptr);
+
+            auto start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            reduced.wait(lock,
+                         [&]() { return doneBuckets == buckets.size(); });
+            exposedSeconds += std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+        } else {
+            network.computeGradients(batchInput, batchTarget);
+        }
+        // The sum covers other ranks' rows too.
+        network.markGradientsDense();
+        return loss;
+    }
+
+    // reduceGradients(), then one optimizer step with the mean over ranks.
+    // Returns the local loss.
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      Optimizer &optimizer) {
+        double loss = reduceGradients(batchInput, batchTarget);
+        network.markGradientsAccumulated(communicator.size() - 1);
+        network.step(optimizer);
+        return loss;
+    }
+
+    // One pass over this rank's shard; returns the mean loss over all
+    // ranks. Shards must be the same size so every rank runs as many
+    // steps.
+    double trainEpoch(const std::vector<VectorXd> &data,
+                      const std::vector<VectorXd> &labels, int batchSize,
+                      Optimizer &optimizer, std::mt19937 &rng) {
+        std::vector<int> indices(data.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i] = i;
+        }
+        std::shuffle(indices.begin(), indices.end(), rng);
+        int numBatches = data.size() / batchSize;
+        double totalLoss = 0.0;
+        for (int batch = 0; batch < numBatches; batch++) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                int idx = indices[batch * batchSize + i];
+                batchInput.col(i) = data[idx];
+                batchTarget.col(i) = labels[idx];
+            }
+            totalLoss += trainBatch(batchInput, batchTarget, optimizer);
+        }
+        double loss = numBatches > 0 ? totalLoss / numBatches : 0.0;
+        return communicator.allReduce(loss) / communicator.size();
+    }
+
+    // Like Network::train on this rank's shard, with the learning rate
+    // decayed every 5 epochs. Rank 0 reports.
+    void train(const std::vector<VectorXd> &data,
+               const std::vector<VectorXd> &labels, double learningRate,
+               int batchSize, int epochs = 20, double decayRate = 0.8) {
+        typedef std::chrono::steady_clock Clock;
+        const bool report = communicator.getRank() == 0;
+        std::mt19937 rng(communicator.getRank());
+        SGD sgd(learningRate);
+        if (communicator.size() > 1 && (int)data.size() >= batchSize) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                batchInput.col(i) = data[i];
+                batchTarget.col(i) = labels[i];
+            }
+            tuneBucketSize(batchInput, batchTarget);
+        }
+        if (report) {
+            std::cout << "\n===== DISTRIBUTED TRAINING ("
+                      << communicator.size() << " ranks, " << data.size()
+                      << " samples per rank, batch " << batchSize
+                      << " per rank) =====\n";
+        }
+        for (int epoch = 0; epoch < epochs; epoch++) {
+            if (epoch > 0 && epoch % 5 == 0) {
+                sgd.setLearningRate(sgd.getLearningRate() * decayRate);
+            }
+            auto start = Clock::now();
+            double reduceBefore = reduceSeconds;
+            double exposedBefore = exposedSeconds;
+            double loss = trainEpoch(data, labels, batchSize, sgd, rng);
+            double seconds =
+                std::chrono::duration<double>(Clock::now() - start).count();
+            double reduce = reduceSeconds - reduceBefore;
+            double exposed = exposedSeconds - exposedBefore;
+            if (report) {
+                std::cout << "Epoch " << (epoch + 1) << "/" << epochs
+                          << " loss " << std::fixed << std::setprecision(6)
+                          << loss << ", " << std::setprecision(2) << seconds
+                          << " s, all-reduce " << reduce << " s ("
+                          << std::max(0.0, reduce - exposed)
+                          << " s hidden behind backward)\n";
+            }
+        }
+        if (report) {
+            std::cout << "Sent " << communicator.bytesSent() / (1 << 20)
+                      << " MiB per rank\n";
+            std::cout << "=======================================\n\n";
+        }
+    }
+
+    // Trains epochs on ranks forked processes from network's current
+    // parameters once per compressor (nullptr = uncompressed all-reduce)
+    // and prints bytes sent per rank and step, step time, the last epoch's
+    // loss and rank 0's test accuracy.
+    static void compareCompressors(
+        Network &network, const std::vector<GradientCompressor *> &compressors,
+        const std::vector<VectorXd> &data, const std::vector<VectorXd> &labels,
+        const std::vector<VectorXd> &testData,
+        const std::vector<VectorXd> &testLabels, int ranks, int batchSize,
+        int epochs, double lr = 0.003) {
+        typedef std::chrono::steady_clock Clock;
+        std::cout << "\n===== GRADIENT COMPRESSION (" << ranks
+                  << " ranks, batch " << batchSize << " per rank, " << epochs
+                  << " epochs) =====\n";
+        for (GradientCompressor *compressor : compressors) {
+            std::fflush(nullptr);
+            // Each rank is a fork, so every run starts from the same
+            // parameters and compressor state.
+            RingCommunicator::launch(ranks, [&](RingCommunicator &comm) {
+                DistributedTrainer trainer(network, comm);
+                trainer.setCompressor(compressor);
+                std::vector<VectorXd> shard =
+                    shard_for_rank(data, comm.getRank(), ranks);
+                std::vector<VectorXd> shardLabels =
+                    shard_for_rank(labels, comm.getRank(), ranks);
+                std::mt19937 rng(comm.getRank());
+                SGD sgd(lr);
+                size_t sentBefore = comm.bytesSent();
+                auto start = Clock::now();
+                double loss = 0.0;
+                for (int epoch = 0; epoch < epochs; epoch++) {
+                    loss = trainer.trainEpoch(shard, shardLabels, batchSize,
+                                              sgd, rng);
+                }
+                double seconds =
+                    std::chrono::duration<double>(Clock::now() - start)
+                        .count();
+                long steps = epochs * (long)(shard.size() / batchSize);
+                double bytes = comm.bytesSent() - sentBefore;
+                if (comm.getRank() == 0) {
+                    double accuracy = network.test(testData, testLabels, true);
+                    std::cout << std::left << std::setw(22)
+                              << (compressor ? compressor->name()
+                                             : std::string("Uncompressed"))
+                              << std::right << std::fixed
+                              << std::setprecision(1) << std::setw(10)
+                              << bytes / steps / 1024.0 << " KiB/step "
+                              << std::setprecision(2) << std::setw(8)
+                              << seconds / steps * 1000.0 << " ms/step  loss "
+                              << std::setprecision(6) << loss << "  accuracy "
+                              << std::setprecision(2) << accuracy << "%\n";
+                }
+                return 0;
+            });
+        }
+        std::cout << "=======================================\n\n";
+    }
+};
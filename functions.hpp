@@ -1,7 +1,11 @@
+#pragma once
+
 #include <Eigen/Dense>
 
 using namespace Eigen;
 
+typedef Matrix<double, Dynamic, Dynamic, RowMajor> RowMatrixXd;
+
 enum class ActivationType {
     RELU,
     SIGMOID,
@@ -73,3 +77,10 @@ inline MatrixXd softmax(const MatrixXd &m) {
 inline MatrixXd dSoftmax(const MatrixXd &m) {
     return MatrixXd::Ones(m.rows(), m.cols());
 }
+
+inline double density(const MatrixXd &m) {
+    if (m.size() == 0) {
+        return 0.0;
+    }
+    return (double)(m.array() != 0.0).count() / m.size();
+}
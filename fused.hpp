@@ -0,0 +1,200 @@
+#pragma once
+
+#include "functions.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Runs a stack of small dense layers back to back on micro-batches of
+// samples. Intermediate activations live in two interleaved scratch tiles
+// (row k holds feature k of every sample in the micro-batch) that stay in L1,
+// so nothing is written back to a full activation matrix between layers.
+class FusedMLP {
+  private:
+    // Weights are repacked into panels of neuronBlock output neurons, with
+    // the neurons of a panel interleaved per input feature, so the kernel
+    // loads one contiguous vector of weights per input and broadcasts the
+    // input across it. Output counts are padded up to whole panels. The
+    // neuronBlock x microBatch accumulator block is sized to half the
+    // target's vector register file.
+    static const int neuronBlock = 2 * internal::packet_traits<double>::size;
+    static const int microBatch =
+        EIGEN_ARCH_DEFAULT_NUMBER_OF_REGISTERS >= 32 ? 8 : 4;
+
+    struct FusedLayer {
+        std::vector<double, aligned_allocator<double>> panels;
+        VectorXd biases;
+        Index inSize;
+        Index outSize;
+        ActivationType activationType;
+        double leakyReluAlpha;
+    };
+
+    std::vector<FusedLayer> layers;
+    Index maxWidth = 0;
+
+    // out(j, c) = bias(j) + sum_k weights(k, j) * in(k, c), with in/out
+    // stored interleaved (row k holds the micro-batch) and a neuronBlock x MB
+    // accumulator block kept in registers. Narrow micro-batches split the
+    // input features over several accumulator blocks so the FMA chains stay
+    // independent.
+    template <int MB>
+    static void denseKernel(const FusedLayer &layer, const double *in,
+                            double *out) {
+        typedef Array<double, neuronBlock, 1> Lane;
+        typedef Array<double, neuronBlock, MB> Block;
+        const int splits = MB >= 4 ? 1 : 4 / MB;
+        const Index inSize = layer.inSize;
+        const Index splitEnd = inSize / splits * splits;
+
+        for (Index j = 0; j < layer.outSize; j += neuronBlock) {
+            const double *panel = layer.panels.data() + j * inSize;
+            Block acc[splits];
+            for (int s = 0; s < splits; s++) {
+                acc[s].setZero();
+            }
+            for (Index k = 0; k < splitEnd; k += splits) {
+                for (int s = 0; s < splits; s++) {
+                    Map<const Lane, Aligned> w(panel +
+                                               (k + s) * neuronBlock);
+                    for (int c = 0; c < MB; c++) {
+                        acc[s].col(c) += w * in[(k + s) * MB + c];
+                    }
+                }
+            }
+            for (Index k = splitEnd; k < inSize; k++) {
+                Map<const Lane, Aligned> w(panel + k * neuronBlock);
+                for (int c = 0; c < MB; c++) {
+                    acc[0].col(c) += w * in[k * MB + c];
+                }
+            }
+            for (int s = 1; s < splits; s++) {
+                acc[0] += acc[s];
+            }
+            Index valid = std::min<Index>(neuronBlock, layer.outSize - j);
+            for (Index jj = 0; jj < valid; jj++) {
+                for (int c = 0; c < MB; c++) {
+                    out[(j + jj) * MB + c] =
+                        acc[0](jj, c) + layer.biases(j + jj);
+                }
+            }
+        }
+    }
+
+    template <int MB>
+    static void activate(const FusedLayer &layer, double *tile) {
+        const Index n = layer.outSize;
+        switch (layer.activationType) {
+        case ActivationType::SIGMOID:
+            for (Index i = 0; i < n * MB; i++) {
+                tile[i] = 1.0 / (1.0 + std::exp(-tile[i]));
+            }
+            break;
+        case ActivationType::LEAKY_RELU:
+            for (Index i = 0; i < n * MB; i++) {
+                tile[i] = std::max(tile[i], layer.leakyReluAlpha * tile[i]);
+            }
+            break;
+        case ActivationType::SOFTMAX:
+            for (int c = 0; c < MB; c++) {
+                double maxVal = tile[c];
+                for (Index j = 1; j < n; j++) {
+                    maxVal = std::max(maxVal, tile[j * MB + c]);
+                }
+                double sum = 0.0;
+                for (Index j = 0; j < n; j++) {
+                    tile[j * MB + c] = std::exp(tile[j * MB + c] - maxVal);
+                    sum += tile[j * MB + c];
+                }
+                for (Index j = 0; j < n; j++) {
+                    tile[j * MB + c] /= sum;
+                }
+            }
+            break;
+        case ActivationType::RELU:
+        default:
+            for (Index i = 0; i < n * MB; i++) {
+                tile[i] = std::max(tile[i], 0.0);
+            }
+            break;
+        }
+    }
+
+    template <int MB>
+    void runTile(const MatrixXd &input, Index col, MatrixXd &result,
+                 double *tileA, double *tileB) const {
+        const Index inSize = input.rows();
+        for (Index k = 0; k < inSize; k++) {
+            for (int c = 0; c < MB; c++) {
+                tileA[k * MB + c] = input(k, col + c);
+            }
+        }
+        for (const FusedLayer &layer : layers) {
+            denseKernel<MB>(layer, tileA, tileB);
+            activate<MB>(layer, tileB);
+            std::swap(tileA, tileB);
+        }
+        const Index outSize = result.rows();
+        for (int c = 0; c < MB; c++) {
+            for (Index j = 0; j < outSize; j++) {
+                result(j, col + c) = tileA[j * MB + c];
+            }
+        }
+    }
+
+  public:
+    bool empty() const { return layers.empty(); }
+
+    void clear() {
+        layers.clear();
+        maxWidth = 0;
+    }
+
+    void addLayer(const MatrixXd &weights, const VectorXd &biases,
+                  ActivationType actType, double leakyReluAlpha = 0.01) {
+        eigen_assert(layers.empty() ||
+                     layers.back().outSize == weights.rows());
+        FusedLayer layer;
+        layer.inSize = weights.rows();
+        layer.outSize = weights.cols();
+        layer.biases = biases;
+        layer.activationType = actType;
+        layer.leakyReluAlpha = leakyReluAlpha;
+
+        Index padded =
+            (layer.outSize + neuronBlock - 1) / neuronBlock * neuronBlock;
+        layer.panels.assign(padded * layer.inSize, 0.0);
+        for (Index j = 0; j < layer.outSize; j++) {
+            double *panel =
+                layer.panels.data() + (j / neuronBlock) * neuronBlock *
+                                          layer.inSize;
+            for (Index k = 0; k < layer.inSize; k++) {
+                panel[k * neuronBlock + j % neuronBlock] = weights(k, j);
+            }
+        }
+
+        layers.push_back(layer);
+        maxWidth = std::max({maxWidth, layer.inSize, layer.outSize});
+    }
+
+    MatrixXd forward(const MatrixXd &input) const {
+        eigen_assert(!layers.empty() &&
+                     input.rows() == layers.front().inSize);
+        const Index cols = input.cols();
+        MatrixXd result(layers.back().outSize, cols);
+
+        std::vector<double, aligned_allocator<double>> scratch(
+            2 * maxWidth * microBatch);
+        double *tileA = scratch.data();
+        double *tileB = tileA + maxWidth * microBatch;
+
+        Index col = 0;
+        for (; col + microBatch <= cols; col += microBatch) {
+            runTile<microBatch>(input, col, result, tileA, tileB);
+        }
+        for (; col < cols; col++) {
+            runTile<1>(input, col, result, tileA, tileB);
+        }
+        return result;
+    }
+};
@@ -1,27 +1,225 @@
+#pragma once
+
 #include "functions.hpp"
+#include "packed.hpp"
+#include "buffers.hpp"
+#include "numa.hpp"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// What a layer keeps from forward for the backward pass. The compact modes
+// drop the pre-activation values, keep a 1-bit sign mask as the derivative
+// of RELU/LEAKY_RELU layers, and FP16/BF16 additionally stash the
+// activations (still needed as the next layer's input) in half precision.
+enum class ActivationStash {
+    FULL,
+    COMPACT,
+    FP16,
+    BF16
+};
+
+// A layer's parameters and gradients, as views into buffers that a Network
+// shares between all of its layers; a standalone layer owns its own. Copies
+// get buffers of their own holding the same values.
+class LayerParameters {
+protected:
+    std::shared_ptr<AlignedBuffer> parameterBuffer;
+    std::shared_ptr<AlignedBuffer> gradientBuffer;
+    // Row-major so the weights of one input feature are contiguous, which
+    // lets the sparse paths skip whole zero input features.
+    Map<RowMatrixXd> weights;
+    Map<VectorXd> biases;
+    Map<RowMatrixXd> weightGradient;
+    Map<VectorXd> biasGradient;
+
+    void bind(double* params, double* grads, Index in, Index out) {
+        new (&weights) Map<RowMatrixXd>(params, in, out);
+        new (&biases) Map<VectorXd>(params + AlignedBuffer::padded(in * out), out);
+        new (&weightGradient) Map<RowMatrixXd>(grads, in, out);
+        new (&biasGradient) Map<VectorXd>(grads + AlignedBuffer::padded(in * out), out);
+    }
+
+    LayerParameters()
+        : weights(nullptr, 0, 0), biases(nullptr, 0),
+          weightGradient(nullptr, 0, 0), biasGradient(nullptr, 0) {}
+
+    LayerParameters(const LayerParameters& other) : LayerParameters() {
+        Index in = other.weights.rows();
+        Index out = other.weights.cols();
+        size_t count = parameterCount(in, out);
+        parameterBuffer = std::make_shared<AlignedBuffer>(count);
+        gradientBuffer = std::make_shared<AlignedBuffer>(count);
+        std::memcpy(parameterBuffer->data(), other.weights.data(), count * sizeof(double));
+        std::memcpy(gradientBuffer->data(), other.weightGradient.data(), count * sizeof(double));
+        bind(parameterBuffer->data(), gradientBuffer->data(), in, out);
+    }
+
+    LayerParameters(LayerParameters&& other) noexcept : LayerParameters() {
+        *this = std::move(other);
+    }
 
-class Layer {
+    LayerParameters& operator=(LayerParameters&& other) noexcept {
+        if (this != &other) {
+            parameterBuffer = std::move(other.parameterBuffer);
+            gradientBuffer = std::move(other.gradientBuffer);
+            bind(other.weights.data(), other.weightGradient.data(),
+                 other.weights.rows(), other.weights.cols());
+            other.bind(nullptr, nullptr, 0, 0);
+        }
+        return *this;
+    }
+
+    LayerParameters& operator=(const LayerParameters&) = delete;
+
+public:
+    // Doubles one layer occupies in a parameter (or gradient) buffer; each
+    // view starts on a cache line.
+    static size_t parameterCount(Index in, Index out) {
+        return AlignedBuffer::padded(in * out) + AlignedBuffer::padded(out);
+    }
+};
+
+class Layer : private LayerParameters {
 private:
-    MatrixXd weights;
-    VectorXd biases;
-    MatrixXd values;
-    MatrixXd activations;
-    MatrixXd delta;
+    // While sparseGradient is set, only the rows listed in gradientRows (and
+    // marked in gradientRowMask) of weightGradient are nonzero.
+    std::vector<int> gradientRows;
+    std::vector<char> gradientRowMask;
+    bool sparseGradient = false;
+    MatrixBuffer values;
+    MatrixBuffer activations;
+    MatrixBuffer delta;
+    // Workspace slots the owning network planned for the buffers above at
+    // batch size cols. Copies start without slots.
+    struct Placement {
+        double* values = nullptr;
+        double* activations = nullptr;
+        double* delta = nullptr;
+        Index cols = 0;
+
+        Placement() = default;
+        Placement(const Placement&) {}
+        Placement& operator=(const Placement&) { return *this; }
+        Placement(Placement&&) noexcept = default;
+        Placement& operator=(Placement&&) noexcept = default;
+    } placement;
+    PackedWeights packedWeights;
+    ActivationStash stash = ActivationStash::FULL;
+    std::vector<uint64_t> signMask;
+    Index maskRows = 0;
+    Index maskCols = 0;
+    Matrix<half, Dynamic, Dynamic> halfStash;
+    Matrix<bfloat16, Dynamic, Dynamic> bf16Stash;
     
     ActivationType activationType = ActivationType::RELU;
     double leakyReluAlpha = 0.01;
+    double sparseInputThreshold = 0.0;
+    double lastInputDensity = 1.0;
+    bool lastInputSparse = false;
+    long inputBatches = 0;
+    long sparseInputBatches = 0;
+    // Weight decay folded into one multiplier: the effective weights are
+    // weightScale * weights, applied on the fly in forward and backward.
+    double weightScale = 1.0;
+
+    // Points buffer at its slot when the batch has the planned size and
+    // sizes its own storage otherwise.
+    void place(MatrixBuffer& buffer, double* slot, Index rows, Index cols) {
+        if (slot != nullptr && cols == placement.cols) {
+            buffer.bind(slot, rows, cols);
+        } else {
+            buffer.resize(rows, cols);
+        }
+    }
+
+    void clearGradientRows() {
+        for (int k : gradientRows) {
+            gradientRowMask[k] = 0;
+        }
+        gradientRows.clear();
+    }
+
+    // y = weights^T * x touching only the weight rows of nonzero inputs.
+    void sparseInputProduct(const MatrixXd& batchInput, MatrixXd& y) const {
+        y.setZero(weights.cols(), batchInput.cols());
+        for (int k = 0; k < batchInput.rows(); k++) {
+            for (int c = 0; c < batchInput.cols(); c++) {
+                double x = batchInput(k, c);
+                if (x != 0.0) {
+                    y.col(c) += x * weights.row(k).transpose();
+                }
+            }
+        }
+    }
 
 public:
     Layer(int in, int out, ActivationType actType = ActivationType::RELU) 
         : activationType(actType) {
+        parameterBuffer = std::make_shared<AlignedBuffer>(parameterCount(in, out));
+        gradientBuffer = std::make_shared<AlignedBuffer>(parameterCount(in, out));
+        bind(parameterBuffer->data(), gradientBuffer->data(), in, out);
         if (actType == ActivationType::RELU || actType == ActivationType::LEAKY_RELU) {
             weights = MatrixXd::Random(in, out) * sqrt(2.0 / in);
         } else {
             weights = MatrixXd::Random(in, out) * sqrt(2.0 / (in + out));
         }
-        biases = VectorXd::Zero(out);
+        biases.setZero();
+        gradientRowMask.assign(in, 0);
+    }
+
+    // Copies own their parameters and gradients; shareParameters() points
+    // a copy back at the original's.
+    Layer(const Layer&) = default;
+    Layer(Layer&&) = default;
+    Layer& operator=(const Layer&) = delete;
+    Layer& operator=(Layer&&) = default;
+
+    using LayerParameters::parameterCount;
+
+    // Moves this layer's parameters and gradients to offset within the given
+    // buffers and points its views there.
+    void bindParameters(const std::shared_ptr<AlignedBuffer>& params,
+                        const std::shared_ptr<AlignedBuffer>& grads,
+                        size_t offset) {
+        Index in = weights.rows();
+        Index out = weights.cols();
+        size_t count = parameterCount(in, out);
+        eigen_assert(offset + count <= params->size() && offset + count <= grads->size());
+        std::memcpy(params->data() + offset, weights.data(), count * sizeof(double));
+        std::memcpy(grads->data() + offset, weightGradient.data(), count * sizeof(double));
+        parameterBuffer = params;
+        gradientBuffer = grads;
+        bind(params->data() + offset, grads->data() + offset, in, out);
+        unfreeze();
     }
     
+    // Points the views at other's parameters and gradients, e.g. for
+    // per-micro-batch copies of one layer. other must have the same shape.
+    void shareParameters(const Layer& other) {
+        eigen_assert(inputs() == other.inputs() && outputs() == other.outputs());
+        parameterBuffer = other.parameterBuffer;
+        gradientBuffer = other.gradientBuffer;
+        bind(parameterBuffer->data() + (other.weights.data() - parameterBuffer->data()),
+             gradientBuffer->data() + (other.weightGradient.data() - gradientBuffer->data()),
+             inputs(), outputs());
+        unfreeze();
+        markGradientDense();
+    }
+
+    // Points the gradient views at offset within grads, which starts out
+    // zero; the parameters stay where they are.
+    void bindGradients(const std::shared_ptr<AlignedBuffer>& grads,
+                       size_t offset) {
+        eigen_assert(offset + parameterCount(inputs(), outputs()) <= grads->size());
+        gradientBuffer = grads;
+        bind(weights.data(), grads->data() + offset, inputs(), outputs());
+        markGradientDense();
+    }
+
     void setActivationType(ActivationType actType) {
         activationType = actType;
     }
@@ -34,13 +232,94 @@ public:
         return activationType;
     }
 
-    void forward(const MatrixXd& batchInput) {
-        MatrixXd y = weights.transpose() * batchInput;
+    double getLeakyReluAlpha() const {
+        return leakyReluAlpha;
+    }
+
+    Index inputs() const {
+        return weights.rows();
+    }
+
+    Index outputs() const {
+        return weights.cols();
+    }
+
+    void freeze() {
+        flushPendingDecay();
+        packedWeights.pack(weights);
+    }
+
+    void unfreeze() {
+        packedWeights.clear();
+    }
+
+    bool isFrozen() const {
+        return !packedWeights.empty();
+    }
+
+    // Batches whose measured input density falls below the threshold skip
+    // the zero input features; 0 keeps the dense path for every batch.
+    void setSparseInputThreshold(double threshold) {
+        sparseInputThreshold = threshold;
+    }
+
+    double getLastInputDensity() const {
+        return lastInputDensity;
+    }
+
+    bool usedSparseInput() const {
+        return lastInputSparse;
+    }
+
+    double getSparseInputFraction() const {
+        if (inputBatches == 0) {
+            return 0.0;
+        }
+        return (double)sparseInputBatches / inputBatches;
+    }
+
+    double getActivationDensity() const {
+        return density(activations);
+    }
+
+    // recompute marks a checkpoint replay of a batch already counted in
+    // the sparse-input statistics.
+    void forward(const MatrixXd& batchInput, bool recompute = false) {
+        MatrixXd y;
+        bool sparse = false;
+        if (sparseInputThreshold > 0.0) {
+            lastInputDensity = density(batchInput);
+            sparse = lastInputDensity < sparseInputThreshold;
+            if (!recompute) {
+                inputBatches++;
+                sparseInputBatches += sparse;
+            }
+        }
+        lastInputSparse = sparse;
+        if (sparse) {
+            sparseInputProduct(batchInput, y);
+        } else if (isFrozen()) {
+            packedWeights.multiply(batchInput, y);
+        } else {
+            y.noalias() = weights.transpose() * batchInput;
+        }
+        if (weightScale != 1.0) {
+            y *= weightScale;
+        }
         for (int i = 0; i < batchInput.cols(); i++) {
             y.col(i) += biases;
         }
-        values = y;
+        signMask.clear();
+        halfStash.resize(0, 0);
+        bf16Stash.resize(0, 0);
+        if (stash == ActivationStash::FULL) {
+            place(values, placement.values, y.rows(), y.cols());
+            values = y;
+        } else {
+            values.release();
+        }
         
+        place(activations, placement.activations, y.rows(), y.cols());
         switch(activationType) {
             case ActivationType::SIGMOID:
                 activations = sigmoid(y);
@@ -77,18 +356,131 @@ public:
         }
     }
 
+    void setActivationStash(ActivationStash mode) {
+        stash = mode;
+    }
+
+    // Compresses what backward needs from the last forward pass according
+    // to the stash mode. Must run after the next layer has consumed the
+    // activations; the output layer is never stashed.
+    void stashActivations() {
+        if (stash == ActivationStash::FULL || activations.size() == 0) {
+            return;
+        }
+        if (activationType == ActivationType::RELU ||
+            activationType == ActivationType::LEAKY_RELU) {
+            maskRows = activations.rows();
+            maskCols = activations.cols();
+            signMask.assign((activations.size() + 63) / 64, 0);
+            for (Index i = 0; i < activations.size(); i++) {
+                if (activations(i) > 0.0) {
+                    signMask[i / 64] |= uint64_t(1) << (i % 64);
+                }
+            }
+        }
+        if (stash == ActivationStash::FP16) {
+            halfStash = activations.cast<half>();
+            activations.release();
+        } else if (stash == ActivationStash::BF16) {
+            bf16Stash = activations.cast<bfloat16>();
+            activations.release();
+        }
+    }
+
+    // Derivative of the activation at the last forward pass, taken from the
+    // sign mask when one was stashed.
+    MatrixXd activationDerivative() const {
+        if (signMask.empty()) {
+            return getActivationDerivative(getActivations());
+        }
+        double negative =
+            activationType == ActivationType::LEAKY_RELU ? leakyReluAlpha
+                                                         : 0.0;
+        MatrixXd result(maskRows, maskCols);
+        for (Index i = 0; i < result.size(); i++) {
+            bool positive = (signMask[i / 64] >> (i % 64)) & 1;
+            result(i) = positive ? 1.0 : negative;
+        }
+        return result;
+    }
+
     MatrixXd getActivations() const {
+        if (halfStash.size() > 0) {
+            return halfStash.cast<double>();
+        }
+        if (bf16Stash.size() > 0) {
+            return bf16Stash.cast<double>();
+        }
         return activations;
     }
 
     VectorXd getActivationVector() const {
-        if (activations.cols() > 0) {
-            return activations.col(0);
+        MatrixXd current = getActivations();
+        if (current.cols() > 0) {
+            return current.col(0);
         }
-        return VectorXd::Zero(activations.rows());
+        return VectorXd::Zero(current.rows());
+    }
+
+    // Moves the per-batch buffers to fresh storage, e.g. after switching
+    // the huge-page arena on or off.
+    void reallocateBuffers() {
+        values.reallocate();
+        activations.reallocate();
+        delta.reallocate();
+    }
+
+    // Lets the next batches of cols samples use the given workspace slots
+    // (null keeps a buffer on its own storage). Current contents move to
+    // own storage first, so the previous workspace can be freed.
+    void placeBuffers(double* valuesSlot, double* activationsSlot,
+                      double* deltaSlot, Index cols) {
+        reallocateBuffers();
+        placement.values = valuesSlot;
+        placement.activations = activationsSlot;
+        placement.delta = deltaSlot;
+        placement.cols = cols;
+    }
+
+    // Reallocates the per-batch buffers on node, now and whenever they
+    // grow (-1: wherever they are first touched).
+    void bindBuffersToNode(int node) {
+        values.setNode(node);
+        activations.setNode(node);
+        delta.setNode(node);
+        reallocateBuffers();
+    }
+
+    const double* activationData() const {
+        return activations.data();
+    }
+
+    void unplaceBuffers() {
+        placeBuffers(nullptr, nullptr, nullptr, 0);
+    }
+
+    bool hasActivations() const {
+        return activations.size() > 0 || halfStash.size() > 0 ||
+               bf16Stash.size() > 0;
+    }
+
+    void releaseActivations() {
+        values.release();
+        activations.release();
+        halfStash.resize(0, 0);
+        bf16Stash.resize(0, 0);
+        signMask.clear();
+    }
+
+    // Bytes held from the last forward pass for backward.
+    size_t activationBytes() const {
+        return (values.size() + activations.size()) * sizeof(double) +
+               (halfStash.size() + bf16Stash.size()) * 2 +
+               signMask.size() * sizeof(uint64_t);
     }
 
     void setDelta(const MatrixXd& d) {
+        place(delta, placement.delta, d.rows(), d.cols());
         delta = d;
     }
 
@@ -96,41 +488,180 @@ public:
         return delta;
     }
 
+    // Error with respect to this layer's input, weights * delta.
+    MatrixXd inputError() const {
+        if (weightScale != 1.0) {
+            return weightScale * (weights * delta);
+        }
+        return weights * delta;
+    }
+
+    // inputError() evaluated only where batchInput is nonzero; the rest is
+    // left at zero. Exact when the previous layer is RELU, whose derivative
+    // zeroes those entries anyway.
+    MatrixXd sparseInputError(const MatrixXd& batchInput) const {
+        MatrixXd error = MatrixXd::Zero(weights.rows(), delta.cols());
+        for (int c = 0; c < batchInput.cols(); c++) {
+            for (int k = 0; k < batchInput.rows(); k++) {
+                if (batchInput(k, c) != 0.0) {
+                    error(k, c) = weightScale * weights.row(k).dot(
+                        delta.col(c).transpose());
+                }
+            }
+        }
+        return error;
+    }
+
     MatrixXd getWeights() const {
+        if (weightScale != 1.0) {
+            return weightScale * weights;
+        }
         return weights;
     }
 
-    void updateWeights(const MatrixXd& batchInput, double lr) {
-        double lambda = 0.0001;
-        
-        MatrixXd dW = batchInput * delta.transpose() / batchInput.cols();
-        VectorXd db = delta.rowwise().mean();
-        
-        dW += lambda * weights;
-        
-        double clipThreshold = 5.0;
-        
-        for (int i = 0; i < dW.rows(); i++) {
-            for (int j = 0; j < dW.cols(); j++) {
-                if (dW(i, j) > clipThreshold) dW(i, j) = clipThreshold;
-                if (dW(i, j) < -clipThreshold) dW(i, j) = -clipThreshold;
-                
-                if (std::isnan(dW(i, j))) {
-                    dW(i, j) = 0.0;
+    // Folds weightScale into the stored weights.
+    void flushPendingDecay() {
+        if (weightScale == 1.0) {
+            return;
+        }
+        weights *= weightScale;
+        weightScale = 1.0;
+    }
+
+    VectorXd getBiases() const {
+        return biases;
+    }
+
+    MatrixXd getWeightGradient() const {
+        return weightGradient;
+    }
+
+    VectorXd getBiasGradient() const {
+        return biasGradient;
+    }
+
+    // Writes this batch's mean gradients into the gradient views, or adds
+    // them to what is there when accumulate is set. Batches below the sparse
+    // input threshold only write the rows of input features that are
+    // nonzero somewhere in the batch, so they cost O(nnz * out) instead of
+    // O(in * out).
+    void computeGradients(const MatrixXd& batchInput, bool accumulate = false) {
+        double scale = 1.0 / batchInput.cols();
+        if (accumulate) {
+            biasGradient += delta.rowwise().sum() * scale;
+        } else {
+            biasGradient = delta.rowwise().sum() * scale;
+        }
+
+        bool sparse = sparseInputThreshold > 0.0 &&
+                      density(batchInput) < sparseInputThreshold;
+        if (!sparse) {
+            if (accumulate) {
+                weightGradient.noalias() +=
+                    batchInput * delta.transpose() * scale;
+            } else {
+                weightGradient.noalias() =
+                    batchInput * delta.transpose() * scale;
+            }
+            clearGradientRows();
+            sparseGradient = false;
+            return;
+        }
+
+        if (!accumulate) {
+            if (sparseGradient) {
+                for (int k : gradientRows) {
+                    weightGradient.row(k).setZero();
                 }
+            } else {
+                weightGradient.setZero();
             }
+            clearGradientRows();
+            sparseGradient = true;
         }
-        
-        for (int i = 0; i < db.size(); i++) {
-            if (db(i) > clipThreshold) db(i) = clipThreshold;
-            if (db(i) < -clipThreshold) db(i) = -clipThreshold;
-            
-            if (std::isnan(db(i))) {
-                db(i) = 0.0;
+
+        RowVectorXd g(weights.cols());
+        for (int k = 0; k < batchInput.rows(); k++) {
+            bool touched = false;
+            for (int c = 0; c < batchInput.cols(); c++) {
+                double x = batchInput(k, c);
+                if (x != 0.0) {
+                    if (!touched) {
+                        g.setZero();
+                        touched = true;
+                    }
+                    g += x * delta.col(c).transpose();
+                }
+            }
+            if (!touched) {
+                continue;
+            }
+            weightGradient.row(k) += g * scale;
+            if (sparseGradient && !gradientRowMask[k]) {
+                gradientRowMask[k] = 1;
+                gradientRows.push_back(k);
             }
         }
-        
-        weights -= lr * dW;
-        biases -= lr * db;
     }
-};
\ No newline at end of file
+
+    // Parameter and gradient views for optimizers. weightsView() holds the
+    // stored weights, which are getWeightScale() times smaller than the
+    // effective ones until flushPendingDecay().
+    Map<RowMatrixXd>& weightsView() {
+        return weights;
+    }
+
+    Map<VectorXd>& biasesView() {
+        return biases;
+    }
+
+    const Map<RowMatrixXd>& weightGradientView() const {
+        return weightGradient;
+    }
+
+    const Map<VectorXd>& biasGradientView() const {
+        return biasGradient;
+    }
+
+    // True when only sparse batches contributed to the weight gradient since
+    // it was last overwritten; rows outside getGradientRows() are zero.
+    bool hasSparseGradient() const {
+        return sparseGradient;
+    }
+
+    const std::vector<int>& getGradientRows() const {
+        return gradientRows;
+    }
+
+    double getWeightScale() const {
+        return weightScale;
+    }
+
+    // For layers that share their weights with another layer's, which
+    // keeps the authoritative scale.
+    void setWeightScale(double scale) {
+        weightScale = scale;
+    }
+
+    // Declares every row of the weight gradient possibly nonzero, e.g.
+    // after other gradients were summed into the buffer.
+    void markGradientDense() {
+        clearGradientRows();
+        sparseGradient = false;
+    }
+
+    // Decays the effective weights by factor without touching the stored
+    // ones. The scale is folded back in once it gets small, long before
+    // the stored weights could overflow.
+    void decayWeights(double factor) {
+        weightScale *= factor;
+        if (weightScale < 1e-3) {
+            flushPendingDecay();
+        }
+    }
+};
+
+// A growing std::vector<Layer> copies its layers, and so detaches them from
+// shared buffers, unless moving them cannot throw.
+static_assert(std::is_nothrow_move_constructible<Layer>::value,
+              "Layer moves must not throw");
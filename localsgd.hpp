@@ -0,0 +1,314 @@
+#pragma once
+
+#include "comm.hpp"
+#include "parallel.hpp"
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Local SGD: every worker trains a replica with parameters of its own for
+// period steps without any communication, then all replicas are averaged.
+// Workers are the threads of this process and, given a communicator, the
+// threads of every rank (the average is taken in-process first, then
+// all-reduced across ranks). With outer momentum the average is treated as
+// a pseudo-gradient step, v = mu * v + (anchor - average) and
+// anchor -= outerLr * v, and every replica restarts from the anchor.
+//
+// With an adaptive period, the drift (mean squared distance of the
+// replicas from their average, relative to its squared norm) is measured
+// at every averaging: below half the target the period doubles, above the
+// target it halves, within [minPeriod, maxPeriod].
+class LocalSGDTrainer {
+  private:
+    Network &network;
+    RingCommunicator *communicator;
+    WorkerPool pool;
+    // Replicas of threads 1 and up; thread 0 trains the network itself.
+    std::vector<Network> replicas;
+    std::vector<SGD> optimizers;
+    // Flat parameters of every replica, refreshed by its own thread after
+    // each local phase.
+    std::vector<double *> views;
+    // Parameters at the last averaging, and the outer momentum buffer.
+    VectorXd anchor;
+    VectorXd velocity;
+    VectorXd average;
+    std::vector<double> partialSums;
+    double outerMomentum = 0.0;
+    double outerLearningRate = 1.0;
+    int period;
+    bool adaptive = false;
+    int minPeriod = 1;
+    int maxPeriod = 64;
+    double targetDrift = 1e-4;
+    double lastDrift = 0.0;
+    long averagings = 0;
+
+    Network &replica(int t) {
+        return t == 0 ? network : replicas[t - 1];
+    }
+
+    int workers() const {
+        return pool.size() * (communicator ? communicator->size() : 1);
+    }
+
+    Index rangeBegin(int t, Index size) const {
+        return size * t / pool.size();
+    }
+
+    // Averages all replicas into the anchor and copies it back to each.
+    void averageReplicas() {
+        const int threads = pool.size();
+        const Index size = anchor.size();
+        pool.run([&](int t) {
+            Index begin = rangeBegin(t, size);
+            Index n = rangeBegin(t + 1, size) - begin;
+            auto sum = average.segment(begin, n);
+            sum = Map<VectorXd>(views[0] + begin, n);
+            for (int r = 1; r < threads; r++) {
+                sum += Map<VectorXd>(views[r] + begin, n);
+            }
+        });
+        if (communicator) {
+            communicator->allReduce(average.data(), size);
+        }
+        average /= workers();
+
+        partialSums.assign(threads, 0.0);
+        pool.run([&](int t) {
+            Index begin = rangeBegin(t, size);
+            Index n = rangeBegin(t + 1, size) - begin;
+            auto avg = average.segment(begin, n);
+            for (int r = 0; r < threads; r++) {
+                partialSums[t] +=
+                    (Map<VectorXd>(views[r] + begin, n) - avg).squaredNorm();
+            }
+            auto a = anchor.segment(begin, n);
+            if (outerMomentum > 0.0 || outerLearningRate != 1.0) {
+                auto v = velocity.segment(begin, n);
+                v = outerMomentum * v + (a - avg);
+                a -= outerLearningRate * v;
+            } else {
+                a = avg;
+            }
+            for (int r = 0; r < threads; r++) {
+                Map<VectorXd>(views[r] + begin, n) = a;
+            }
+        });
+
+        double spread = 0.0;
+        for (double s : partialSums) {
+            spread += s;
+        }
+        if (communicator) {
+            spread = communicator->allReduce(spread);
+        }
+        double norm = average.squaredNorm();
+        lastDrift = norm > 0.0 ? spread / workers() / norm : 0.0;
+        averagings++;
+
+        if (adaptive) {
+            if (lastDrift < targetDrift / 2) {
+                period = std::min(maxPeriod, period * 2);
+            } else if (lastDrift > targetDrift) {
+                period = std::max(minPeriod, period / 2);
+            }
+        }
+    }
+
+  public:
+    // threads replicas in this process; with a communicator, every rank runs
+    // the same number of threads and starts from rank 0's parameters.
+    LocalSGDTrainer(Network &network, int threads, int period,
+                    double lr = 0.003,
+                    RingCommunicator *communicator = nullptr)
+        : network(network), communicator(communicator),
+          pool(std::max(1, threads), true), period(std::max(1, period)) {
+        anchor = network.parameterVector();
+        if (communicator) {
+            communicator->broadcast(anchor.data(), anchor.size());
+            network.parameterVector() = anchor;
+        }
+        velocity.setZero(anchor.size());
+        average.setZero(anchor.size());
+        for (int t = 1; t < pool.size(); t++) {
+            replicas.push_back(network.replica());
+        }
+        optimizers.assign(pool.size(), SGD(lr));
+        views.resize(pool.size());
+        // Each replica allocates its parameters on its own thread.
+        pool.run([&](int t) {
+            if (t > 0) {
+                replicas[t - 1].detachParameters();
+            }
+            views[t] = replica(t).parameterVector().data();
+        });
+    }
+
+    void setLearningRate(double lr) {
+        for (SGD &sgd : optimizers) {
+            sgd.setLearningRate(lr);
+        }
+    }
+
+    void setPeriod(int steps) {
+        period = std::max(1, steps);
+        adaptive = false;
+    }
+
+    void setAdaptivePeriod(int minSteps, int maxSteps,
+                           double drift = 1e-4) {
+        minPeriod = std::max(1, minSteps);
+        maxPeriod = std::max(minPeriod, maxSteps);
+        period = std::min(maxPeriod, std::max(minPeriod, period));
+        targetDrift = drift;
+        adaptive = true;
+    }
+
+    // momentum 0 and outerLr 1 is plain averaging.
+    void setOuterMomentum(double momentum, double outerLr = 1.0) {
+        outerMomentum = momentum;
+        outerLearningRate = outerLr;
+    }
+
+    int getPeriod() const {
+        return period;
+    }
+
+    double getLastDrift() const {
+        return lastDrift;
+    }
+
+    long getAveragings() const {
+        return averagings;
+    }
+
+    // One shuffled pass over this process's data: thread t takes every
+    // threads-th batch, and the replicas are averaged every period steps and
+    // at the end, after which the network holds the anchor. Returns the mean
+    // loss over all workers.
+    double trainEpoch(const std::vector<VectorXd> &data,
+                      const std::vector<VectorXd> &labels, int batchSize,
+                      std::mt19937 &rng) {
+        const int threads = pool.size();
+        std::vector<int> indices(data.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i] = i;
+        }
+        std::shuffle(indices.begin(), indices.end(), rng);
+        const int stepsPerThread = data.size() / batchSize / threads;
+        std::vector<double> losses(threads, 0.0);
+
+        for (int step = 0; step < stepsPerThread;) {
+            int steps = std::min(period, stepsPerThread - step);
+            pool.run([&](int t) {
+                Network &net = replica(t);
+                MatrixXd batchInput(data[0].size(), batchSize);
+                MatrixXd batchTarget(labels[0].size(), batchSize);
+                for (int s = step; s < step + steps; s++) {
+                    int batch = s * threads + t;
+                    for (int i = 0; i < batchSize; i++) {
+                        int idx = indices[batch * batchSize + i];
+                        batchInput.col(i) = data[idx];
+                        batchTarget.col(i) = labels[idx];
+                    }
+                    net.forward(batchInput);
+                    losses[t] += MSE(batchTarget, net.getOutput());
+                    net.computeGradients(batchInput, batchTarget);
+                    net.step(optimizers[t]);
+                }
+                // Folds pending weight decay into the stored parameters.
+                net.parameterVector();
+            });
+            step += steps;
+            averageReplicas();
+        }
+
+        double loss = 0.0;
+        for (double l : losses) {
+            loss += l;
+        }
+        if (communicator) {
+            loss = communicator->allReduce(loss);
+        }
+        return stepsPerThread > 0 ? loss / (stepsPerThread * workers())
+                                  : 0.0;
+    }
+
+    // Trains epochs from network's current parameters with each period
+    // (0 = adaptive in [1, 64]) on threads replicas per process, and prints
+    // time, averagings, final period and test accuracy. With ranks > 1 each
+    // run forks that many ranks, each training on its shard of the data.
+    // The parameters are restored afterwards.
+    static void comparePeriods(Network &network,
+                               const std::vector<int> &periods,
+                               const std::vector<VectorXd> &data,
+                               const std::vector<VectorXd> &labels,
+                               const std::vector<VectorXd> &testData,
+                               const std::vector<VectorXd> &testLabels,
+                               int threads, int batchSize, int epochs,
+                               double lr = 0.003,
+                               double outerMomentum = 0.0, int ranks = 1) {
+        typedef std::chrono::steady_clock Clock;
+        std::vector<double> initial = network.snapshotParameters();
+        std::cout << "\n===== LOCAL SGD (";
+        if (ranks > 1) {
+            std::cout << ranks << " ranks x ";
+        }
+        std::cout << threads << " threads, batch " << batchSize << ", "
+                  << epochs << " epochs, outer momentum " << outerMomentum
+                  << ") =====\n";
+        for (int period : periods) {
+            network.restoreParameters(initial);
+            auto run = [&](RingCommunicator *comm) {
+                const int rank = comm ? comm->getRank() : 0;
+                std::vector<VectorXd> shard =
+                    shard_for_rank(data, rank, ranks);
+                std::vector<VectorXd> shardLabels =
+                    shard_for_rank(labels, rank, ranks);
+                LocalSGDTrainer trainer(network, threads,
+                                        std::max(1, period), lr, comm);
+                if (period == 0) {
+                    trainer.setAdaptivePeriod(1, 64);
+                }
+                if (outerMomentum > 0.0) {
+                    trainer.setOuterMomentum(outerMomentum);
+                }
+                std::mt19937 rng(42 + rank);
+                auto start = Clock::now();
+                double loss = 0.0;
+                for (int epoch = 0; epoch < epochs; epoch++) {
+                    loss = trainer.trainEpoch(shard, shardLabels, batchSize,
+                                              rng);
+                }
+                double seconds =
+                    std::chrono::duration<double>(Clock::now() - start)
+                        .count();
+                if (rank != 0) {
+                    return 0;
+                }
+                double accuracy = network.test(testData, testLabels, true);
+                std::cout << (period == 0 ? std::string("adaptive")
+                                          : "K = " + std::to_string(period))
+                          << ": " << std::fixed << std::setprecision(2)
+                          << seconds << " s, " << trainer.getAveragings()
+                          << " averagings, final K " << trainer.getPeriod()
+                          << ", loss " << std::setprecision(6) << loss
+                          << ", accuracy " << std::setprecision(2)
+                          << accuracy << "%\n";
+                return 0;
+            };
+            if (ranks > 1) {
+                RingCommunicator::launch(
+                    ranks, [&](RingCommunicator &comm) { return run(&comm); });
+            } else {
+                run(nullptr);
+            }
+        }
+        std::cout << "=======================================\n\n";
+        network.restoreParameters(initial);
+    }
+};
@@ -1,5 +1,11 @@
 #include "data.hpp"
+#include "distributed.hpp"
+#include "localsgd.hpp"
 #include "network.hpp"
+#include "paramserver.hpp"
+#include "pipeline.hpp"
+#include "sharded.hpp"
+#include "tensor.hpp"
 #include <ctime>
 
 const std::string mnist_train_data_path = "dataset/train-images.idx3-ubyte";
@@ -9,7 +15,7 @@ const std::string mnist_test_label_path = "dataset/t10k-labels.idx1-ubyte";
 
 using namespace Eigen;
 
-int main() {
+int main(int argc, char **argv) {
     srand(time(nullptr));
 
     std::vector<VectorXd> trainingData;
@@ -45,9 +51,188 @@ int main() {
     int epochs = 16;
     double decayRate = 0.95;
 
+    if (argc > 1 && std::string(argv[1]) == "--compare-optimizers") {
+        SGD sgd(learningRate);
+        Momentum momentum(learningRate);
+        Momentum nesterov(learningRate, 0.9, 0.0001, true);
+        Adam adam(0.001);
+        AdamW adamW(0.001);
+        network.compareTimeToAccuracy({{"SGD", &sgd},
+                                       {"Momentum", &momentum},
+                                       {"Nesterov", &nesterov},
+                                       {"Adam", &adam},
+                                       {"AdamW", &adamW}},
+                                      trainingData, trainingDataLabels,
+                                      testingDataset, testingDatasetLabels,
+                                      batchSize, 97.0);
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--compare-compression") {
+        TopKCompressor topK(0.01);
+        QuantizingCompressor int8(8);
+        QuantizingCompressor int4(4);
+        PowerSGDCompressor powerSGD(4);
+        DistributedTrainer::compareCompressors(
+            network, {nullptr, &topK, &int8, &int4, &powerSGD}, trainingData,
+            trainingDataLabels, testingDataset, testingDatasetLabels,
+            std::atoi(argv[2]), batchSize, 2, learningRate);
+        return 0;
+    }
+
+    // --compare-local-sgd THREADS [RANKS]
+    if (argc > 2 && std::string(argv[1]) == "--compare-local-sgd") {
+        LocalSGDTrainer::comparePeriods(
+            network, {1, 4, 16, 0}, trainingData, trainingDataLabels,
+            testingDataset, testingDatasetLabels, std::atoi(argv[2]),
+            batchSize, 2, learningRate, 0.0,
+            argc > 3 ? std::max(1, std::atoi(argv[3])) : 1);
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--compare-parameter-server") {
+        ParameterServer::compareWithSynchronous(
+            network, {0, 2, 8, -1}, trainingData, trainingDataLabels,
+            testingDataset, testingDatasetLabels, std::atoi(argv[2]), 2,
+            batchSize, 2, learningRate);
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--compare-sharding") {
+        ShardedTrainer::compareStages(
+            network, trainingData, trainingDataLabels, testingDataset,
+            testingDatasetLabels, std::atoi(argv[2]), batchSize, 4, 2);
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--compare-inference-latency") {
+        network.compareInferenceLatency(testingDataset, batchSize);
+        return 0;
+    }
+
+    // --report-activation-density [THRESHOLD]: one epoch, then per-layer
+    // densities and how often the sparse-input path was taken.
+    if (argc > 1 && std::string(argv[1]) == "--report-activation-density") {
+        network.setActivationStats(true);
+        if (argc > 2) {
+            network.setActivationSparsity(std::atof(argv[2]));
+        }
+        network.train(trainingData, trainingDataLabels, learningRate,
+                      batchSize, 1, decayRate);
+        network.printActivationDensity();
+        return 0;
+    }
+
+    // --report-activation-memory [full|compact|fp16|bf16]: one epoch with
+    // that activation stash, then the bytes each layer keeps for backward.
+    if (argc > 1 && std::string(argv[1]) == "--report-activation-memory") {
+        std::string mode = argc > 2 ? argv[2] : "full";
+        network.setActivationStash(mode == "compact" ? ActivationStash::COMPACT
+                                   : mode == "fp16"  ? ActivationStash::FP16
+                                   : mode == "bf16"  ? ActivationStash::BF16
+                                                     : ActivationStash::FULL);
+        network.train(trainingData, trainingDataLabels, learningRate,
+                      batchSize, 1, decayRate);
+        network.printActivationMemory();
+        return 0;
+    }
+
+    // --report-checkpoints: one epoch with sqrt(N) checkpoints, then peak
+    // activation bytes and the recomputation overhead.
+    if (argc > 1 && std::string(argv[1]) == "--report-checkpoints") {
+        network.setAutoCheckpoints();
+        network.train(trainingData, trainingDataLabels, learningRate,
+                      batchSize, 1, decayRate);
+        network.printCheckpointReport();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--compare-huge-pages") {
+        network.compareHugePages(trainingData, trainingDataLabels, batchSize);
+        return 0;
+    }
+
+    // --report-memory-plan [BATCH]
+    if (argc > 1 && std::string(argv[1]) == "--report-memory-plan") {
+        network.setMemoryPlanning(true);
+        network.printMemoryPlan(argc > 2 ? std::atoi(argv[2]) : batchSize);
+        return 0;
+    }
+
+    // --report-numa [NODE]: one epoch, optionally with every buffer bound
+    // to NODE, then the node behind each buffer.
+    if (argc > 1 && std::string(argv[1]) == "--report-numa") {
+        if (argc > 2) {
+            network.bindToNode(std::atoi(argv[2]));
+        }
+        network.train(trainingData, trainingDataLabels, learningRate,
+                      batchSize, 1, decayRate);
+        network.printNumaPlacement();
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--compare-data-parallel") {
+        DataParallelTrainer::compareScaling(network, trainingData,
+                                            trainingDataLabels, batchSize,
+                                            std::atoi(argv[2]));
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--compare-hogwild") {
+        HogwildTrainer::compareWithSynchronous(
+            network, trainingData, trainingDataLabels, testingDataset,
+            testingDatasetLabels, batchSize, std::atoi(argv[2]));
+        return 0;
+    }
+
+    // --compare-pipeline STAGES [MICRO_BATCHES]
+    if (argc > 2 && std::string(argv[1]) == "--compare-pipeline") {
+        PipelineTrainer::compareSchedules(
+            network, trainingData, trainingDataLabels, batchSize,
+            std::atoi(argv[2]), argc > 3 ? std::atoi(argv[3]) : 4);
+        return 0;
+    }
+
+    // Synthetic 784-W-W-10 networks; the loaded data is not used.
+    if (argc > 2 && std::string(argv[1]) == "--compare-tensor-parallel") {
+        TensorParallelNetwork::compareScaling({256, 1024, 4096}, batchSize,
+                                              std::atoi(argv[2]));
+        return 0;
+    }
+
+    // One rank of multi-process training: shard the data, train, and test
+    // on rank 0.
+    auto runRank = [&](RingCommunicator &communicator) {
+        int rank = communicator.getRank();
+        int ranks = communicator.size();
+        DistributedTrainer trainer(network, communicator);
+        trainer.train(shard_for_rank(trainingData, rank, ranks),
+                      shard_for_rank(trainingDataLabels, rank, ranks),
+                      learningRate, batchSize, epochs, decayRate);
+        if (rank == 0) {
+            network.freeze();
+            network.test(testingDataset, testingDatasetLabels);
+        }
+        return 0;
+    };
+    if (std::unique_ptr<RingCommunicator> communicator =
+            RingCommunicator::fromEnvironment()) {
+        return runRank(*communicator);
+    }
+    if (argc > 2 && std::string(argv[1]) == "--ranks") {
+        Transport transport = argc > 3 && std::string(argv[3]) == "--tcp"
+                                  ? Transport::TCP
+                                  : Transport::UNIX;
+        return RingCommunicator::launch(std::atoi(argv[2]), runRank,
+                                        transport) == 0
+                   ? 0
+                   : 1;
+    }
+
     network.train(trainingData, trainingDataLabels, learningRate, batchSize,
                   epochs, decayRate);
 
+    network.freeze();
     network.test(testingDataset, testingDatasetLabels);
 
     return 0;
@@ -1,33 +1,760 @@
+#pragma once
+
+#include "fused.hpp"
 #include "layer.hpp"
+#include "optimizer.hpp"
+#include "planner.hpp"
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iomanip>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <type_traits>
 #include <vector>
 
-class Network {
-  private:
+// The layers of a Network and the flat buffers their views point into.
+// Copies get buffers of their own holding the same values.
+class LayerStack {
+  protected:
     std::vector<Layer> layers;
+    // All layer parameters, and separately all gradients, in one contiguous
+    // buffer each; every layer holds Map views at its own offset.
+    std::shared_ptr<AlignedBuffer> parameters;
+    std::shared_ptr<AlignedBuffer> gradients;
+    // NUMA node of the buffers this network allocates (-1: first touch).
+    int memoryNode = -1;
+
+    void flattenParameters() {
+        size_t total = 0;
+        for (const Layer &layer : layers) {
+            total += Layer::parameterCount(layer.inputs(), layer.outputs());
+        }
+        auto params = std::make_shared<AlignedBuffer>(total, memoryNode);
+        auto grads = std::make_shared<AlignedBuffer>(total, memoryNode);
+        size_t offset = 0;
+        for (Layer &layer : layers) {
+            layer.bindParameters(params, grads, offset);
+            offset += Layer::parameterCount(layer.inputs(), layer.outputs());
+        }
+        parameters = params;
+        gradients = grads;
+    }
+
+    LayerStack() = default;
+
+    LayerStack(const LayerStack &other)
+        : layers(other.layers), memoryNode(other.memoryNode) {
+        flattenParameters();
+    }
+
+    LayerStack(LayerStack &&) = default;
+    LayerStack &operator=(LayerStack &&) = default;
+};
+
+// Copies of a Network own their parameters and gradients; replica() gives a
+// copy that shares them.
+class Network : private LayerStack {
+  private:
+    FusedMLP fusedTail;
+    size_t fusedFrom = 0;
+    int fusedMaxWidth = 512;
+    double activationSparsityThreshold = 0.0;
+    ActivationStash activationStash = ActivationStash::FULL;
+    std::vector<double> activationDensitySum;
+    long densityBatches = 0;
+    bool activationStats = false;
+    // Layers whose activations survive forward when checkpointing; the rest
+    // are recomputed segment by segment during backward.
+    std::vector<bool> checkpoints;
+    size_t peakActivationBytes = 0;
+    size_t peakFullActivationBytes = 0;
+    double forwardFlops = 0.0;
+    double recomputeFlops = 0.0;
+    // When planning, the values, activations and delta of all layers live
+    // in one workspace laid out from their lifetimes over a training step;
+    // inference alternates between two ping-pong buffers instead.
+    bool memoryPlanning = false;
+    // Micro-batches whose gradients were summed since the last step.
+    int accumulatedBatches = 0;
+    int accumulationSteps = 1;
+    SGD sgd;
+    // Averaged gradients whose global L2 norm exceeds maxGradientNorm are
+    // scaled down to it (0 disables); steps with a non-finite norm are
+    // skipped when skipNonFinite is set.
+    double maxGradientNorm = 5.0;
+    bool skipNonFinite = true;
+    double lastGradientNorm = 0.0;
+    long clippedSteps = 0;
+    long skippedSteps = 0;
+    std::function<void(size_t)> gradientHook;
+    std::function<double(double)> gradientNormReduction;
+    Workspace trainingWorkspace;
+    Workspace inferenceWorkspace;
+
+    bool isCheckpointing() const {
+        return !checkpoints.empty();
+    }
+
+    bool keepsActivations(size_t i) const {
+        return !isCheckpointing() || checkpoints[i] || i + 1 == layers.size();
+    }
+
+    double layerFlops(size_t i, Index batchSize) const {
+        const Layer &layer = layers[i];
+        return 2.0 * layer.inputs() * layer.outputs() * batchSize;
+    }
+
+    size_t liveActivationBytes() const {
+        size_t total = 0;
+        for (const Layer &layer : layers) {
+            total += layer.activationBytes();
+        }
+        return total;
+    }
+
+    // Called once layer i + 1 has consumed layer i's activations.
+    void retireActivations(size_t i) {
+        if (keepsActivations(i)) {
+            layers[i].stashActivations();
+        } else {
+            layers[i].releaseActivations();
+        }
+    }
+
+    // Re-runs forward from the nearest layer that still holds activations
+    // (or the batch input) up to layer i.
+    void recomputeSegment(int i, const MatrixXd &batchInput) {
+        int start = i;
+        while (start > 0 && !layers[start - 1].hasActivations()) {
+            start--;
+        }
+        for (int j = start; j <= i; j++) {
+            if (j == 0) {
+                layers[j].forward(batchInput, true);
+            } else {
+                layers[j].forward(layers[j - 1].getActivations(), true);
+            }
+            recomputeFlops += layerFlops(j, batchInput.cols());
+        }
+        peakActivationBytes =
+            std::max(peakActivationBytes, liveActivationBytes());
+    }
+
+    // Lifetimes over one training step of N layers: step i runs layer i's
+    // forward, step N computes the output delta, step 2N - 1 - i computes
+    // layer i's delta and updates layer i + 1, and step 2N updates layer 0.
+    // Pre-activation values are dead right after forward; half-precision
+    // stashes keep activations only until the next layer has read them.
+    MemoryPlanner planTrainingStep(Index batchSize,
+                                   std::vector<int> &slots) const {
+        MemoryPlanner planner;
+        const int n = layers.size();
+        slots.assign(3 * n, -1);
+        bool halfStash = activationStash == ActivationStash::FP16 ||
+                         activationStash == ActivationStash::BF16;
+        for (int i = 0; i < n; i++) {
+            size_t size = layers[i].outputs() * batchSize;
+            if (activationStash == ActivationStash::FULL) {
+                slots[3 * i] = planner.add(size, i, i);
+            }
+            int lastUse = i + 1 == n ? n : 2 * n - 1 - i;
+            if (halfStash && i + 1 < n) {
+                lastUse = i + 1;
+            }
+            slots[3 * i + 1] = planner.add(size, i, lastUse);
+            int firstDelta = i + 1 == n ? n : 2 * n - 1 - i;
+            slots[3 * i + 2] = planner.add(size, firstDelta, 2 * n - i);
+        }
+        planner.plan();
+        return planner;
+    }
+
+    size_t pingPongSize(Index batchSize) const {
+        Index widest = 0;
+        for (const Layer &layer : layers) {
+            widest = std::max(widest, layer.outputs());
+        }
+        return AlignedBuffer::padded(widest * batchSize);
+    }
+
+    void unplaceLayers() {
+        for (Layer &layer : layers) {
+            layer.unplaceBuffers();
+        }
+        trainingWorkspace.active = false;
+        inferenceWorkspace.active = false;
+    }
+
+    void placeTrainingBuffers(Index batchSize) {
+        if (!memoryPlanning || isCheckpointing()) {
+            if (trainingWorkspace.active || inferenceWorkspace.active) {
+                unplaceLayers();
+            }
+            return;
+        }
+        if (trainingWorkspace.active &&
+            trainingWorkspace.batchSize == batchSize) {
+            return;
+        }
+        std::vector<int> slots;
+        MemoryPlanner planner = planTrainingStep(batchSize, slots);
+        // Layers may still point into the old workspace; it is freed only
+        // after placeBuffers() has moved their contents out.
+        std::unique_ptr<AlignedBuffer> buffer = std::move(
+            trainingWorkspace.buffer);
+        std::unique_ptr<AlignedBuffer> retired;
+        if (!buffer || buffer->size() < planner.size()) {
+            retired = std::move(buffer);
+            buffer.reset(new AlignedBuffer(planner.size(), memoryNode));
+        }
+        for (size_t i = 0; i < layers.size(); i++) {
+            double *slot[3];
+            for (int k = 0; k < 3; k++) {
+                int id = slots[3 * i + k];
+                slot[k] = id < 0 ? nullptr
+                                 : buffer->data() + planner.offset(id);
+            }
+            layers[i].placeBuffers(slot[0], slot[1], slot[2], batchSize);
+        }
+        trainingWorkspace.buffer = std::move(buffer);
+        trainingWorkspace.batchSize = batchSize;
+        trainingWorkspace.active = true;
+        inferenceWorkspace.active = false;
+    }
+
+    // Layer i writes its values and activations into buffer i % 2, so only
+    // the output layer's activations are valid after infer().
+    void placeInferenceBuffers(Index batchSize) {
+        if (!memoryPlanning) {
+            if (trainingWorkspace.active || inferenceWorkspace.active) {
+                unplaceLayers();
+            }
+            return;
+        }
+        if (inferenceWorkspace.active &&
+            inferenceWorkspace.batchSize == batchSize) {
+            return;
+        }
+        size_t size = pingPongSize(batchSize);
+        std::unique_ptr<AlignedBuffer> buffer = std::move(
+            inferenceWorkspace.buffer);
+        std::unique_ptr<AlignedBuffer> retired;
+        if (!buffer || buffer->size() < 2 * size) {
+            retired = std::move(buffer);
+            buffer.reset(new AlignedBuffer(2 * size, memoryNode));
+        }
+        for (size_t i = 0; i < layers.size(); i++) {
+            double *slot = buffer->data() + (i % 2) * size;
+            layers[i].placeBuffers(slot, slot, nullptr, batchSize);
+        }
+        inferenceWorkspace.buffer = std::move(buffer);
+        inferenceWorkspace.batchSize = batchSize;
+        inferenceWorkspace.active = true;
+        trainingWorkspace.active = false;
+    }
+
+    std::vector<std::pair<MatrixXd, MatrixXd>>
+    sampleBatches(const std::vector<VectorXd> &data,
+                  const std::vector<VectorXd> &labels, int batchSize,
+                  int count) const {
+        std::vector<std::pair<MatrixXd, MatrixXd>> batches;
+        for (int b = 0; b < count; b++) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                int idx = (b * batchSize + i) % data.size();
+                batchInput.col(i) = data[idx];
+                batchTarget.col(i) = labels[idx];
+            }
+            batches.emplace_back(batchInput, batchTarget);
+        }
+        return batches;
+    }
+
+    void applyActivationSparsity() {
+        for (size_t i = 1; i < layers.size(); i++) {
+            bool reluInput =
+                layers[i - 1].getActivationType() == ActivationType::RELU;
+            layers[i].setSparseInputThreshold(
+                reluInput ? activationSparsityThreshold : 0.0);
+        }
+        activationDensitySum.assign(layers.size(), 0.0);
+        densityBatches = 0;
+    }
+
+    void buildFusedTail() {
+        fusedTail.clear();
+        fusedFrom = layers.size();
+        while (fusedFrom > 0) {
+            const MatrixXd weights = layers[fusedFrom - 1].getWeights();
+            if (weights.rows() > fusedMaxWidth ||
+                weights.cols() > fusedMaxWidth) {
+                break;
+            }
+            fusedFrom--;
+        }
+        if (layers.size() - fusedFrom < 2) {
+            fusedFrom = layers.size();
+            return;
+        }
+        for (size_t i = fusedFrom; i < layers.size(); i++) {
+            fusedTail.addLayer(layers[i].getWeights(), layers[i].getBiases(),
+                               layers[i].getActivationType(),
+                               layers[i].getLeakyReluAlpha());
+        }
+    }
 
   public:
     Network(int in, int hidden, ActivationType actType = ActivationType::RELU) {
         layers.emplace_back(in, hidden, actType);
+        layers[0].setSparseInputThreshold(0.3);
+        applyActivationSparsity();
+        flattenParameters();
+    }
+
+    Network(const Network &) = default;
+    Network(Network &&) = default;
+    Network &operator=(Network &&) = default;
+
+    // Input density below which the first layer switches to the sparse
+    // input path (MNIST batches sit around 0.19); 0 forces the dense GEMM.
+    void setSparseInputThreshold(double threshold) {
+        layers[0].setSparseInputThreshold(threshold);
     }
 
     void addLayer(int neurons, ActivationType actType = ActivationType::RELU) {
         int in = layers.back().getWeights().cols();
         layers.emplace_back(in, neurons, actType);
+        layers.back().setActivationStash(activationStash);
+        applyActivationSparsity();
+        trainingWorkspace.active = false;
+        inferenceWorkspace.active = false;
+        if (isCheckpointing()) {
+            checkpoints.push_back(false);
+        }
+        flattenParameters();
+    }
+
+    // Lets layers fed by RELU activations skip the zero activations of a
+    // batch in forward, in the weight gradient and in backpropagating the
+    // error, whenever the batch density is below threshold. 0 disables it.
+    // Per-layer densities are tracked while it is on.
+    void setActivationSparsity(double threshold) {
+        activationSparsityThreshold = threshold;
+        applyActivationSparsity();
+    }
+
+    // Tracks per-layer activation densities for printActivationDensity()
+    // even with activation sparsity off; this costs one extra pass over
+    // every layer's activations per training batch.
+    void setActivationStats(bool enabled) {
+        activationStats = enabled;
+    }
+
+    // Keeps activations only at the given layers (plus the output layer)
+    // and recomputes the segments in between during backward.
+    void setCheckpoints(const std::vector<int> &layerIndices) {
+        checkpoints.assign(layers.size(), false);
+        for (int i : layerIndices) {
+            if (i >= 0 && i < (int)layers.size()) {
+                checkpoints[i] = true;
+            }
+        }
+        resetMemoryStats();
+    }
+
+    // Checkpoints every sqrt(N)-th layer, so N layers keep about sqrt(N)
+    // boundaries plus one sqrt(N)-long segment alive at a time.
+    void setAutoCheckpoints() {
+        int stride = std::max(1, (int)std::lround(std::sqrt(layers.size())));
+        std::vector<int> indices;
+        for (int i = stride - 1; i < (int)layers.size(); i += stride) {
+            indices.push_back(i);
+        }
+        setCheckpoints(indices);
+    }
+
+    void disableCheckpointing() {
+        checkpoints.clear();
+        resetMemoryStats();
+    }
+
+    void resetMemoryStats() {
+        peakActivationBytes = 0;
+        peakFullActivationBytes = 0;
+        forwardFlops = 0.0;
+        recomputeFlops = 0.0;
+    }
+
+    void printCheckpointReport() const {
+        std::cout << "\n===== CHECKPOINTING =====\n";
+        std::cout << "Kept layers: ";
+        for (size_t i = 0; i < layers.size(); i++) {
+            if (keepsActivations(i)) {
+                std::cout << i << " ";
+            }
+        }
+        std::cout << "\n";
+        std::cout << "Peak activation bytes: " << peakActivationBytes
+                  << " (all layers kept: " << peakFullActivationBytes
+                  << ")\n";
+        double overhead =
+            forwardFlops > 0.0 ? recomputeFlops / forwardFlops * 100.0 : 0.0;
+        std::cout << "Recomputed forward FLOPs: " << std::fixed
+                  << std::setprecision(1) << overhead << "% of forward\n";
+        std::cout << "=========================\n\n";
+    }
+
+    void setActivationStash(ActivationStash mode) {
+        activationStash = mode;
+        trainingWorkspace.active = false;
+        for (Layer &layer : layers) {
+            layer.setActivationStash(mode);
+        }
+    }
+
+    // Plans the values, activations and delta buffers of every layer into
+    // one workspace from their lifetimes (see planTrainingStep). Training
+    // with checkpoints keeps per-layer buffers.
+    void setMemoryPlanning(bool enabled) {
+        memoryPlanning = enabled;
+        if (!enabled) {
+            unplaceLayers();
+        }
+    }
+
+    void printMemoryPlan(Index batchSize) const {
+        std::vector<int> slots;
+        MemoryPlanner planner = planTrainingStep(batchSize, slots);
+        std::cout << "\n===== MEMORY PLAN (batch " << batchSize
+                  << ") =====\n";
+        std::cout << "Layer buffers: " << planner.naiveSize() * sizeof(double)
+                  << " bytes naive peak (one buffer each)\n";
+        std::cout << "Planned workspace: " << planner.size() * sizeof(double)
+                  << " bytes (live lower bound "
+                  << planner.peakLiveSize() * sizeof(double) << ")\n";
+        std::cout << "Inference ping-pong: "
+                  << 2 * pingPongSize(batchSize) * sizeof(double)
+                  << " bytes\n";
+        if (isCheckpointing()) {
+            std::cout << "Checkpointing is on; training keeps per-layer "
+                         "buffers\n";
+        }
+        std::cout << "====================================\n\n";
+    }
+
+    // Bytes each layer holds for backward after the last forward pass.
+    void printActivationMemory() const {
+        std::cout << "\n===== ACTIVATION MEMORY =====\n";
+        size_t total = 0;
+        for (size_t i = 0; i < layers.size(); i++) {
+            size_t bytes = layers[i].activationBytes();
+            total += bytes;
+            std::cout << "Layer " << i << " ("
+                      << layers[i].getWeights().cols()
+                      << " units): " << bytes << " bytes\n";
+        }
+        std::cout << "Total: " << total << " bytes\n";
+        std::cout << "=============================\n\n";
+    }
+
+    void printActivationDensity() const {
+        std::cout << "\n===== ACTIVATION DENSITY =====\n";
+        for (size_t i = 0; i < layers.size(); i++) {
+            double avg = densityBatches > 0
+                             ? activationDensitySum[i] / densityBatches
+                             : 0.0;
+            std::cout << "Layer " << i << " ("
+                      << layers[i].getWeights().cols()
+                      << " units): density " << std::fixed
+                      << std::setprecision(3) << avg;
+            if (i + 1 < layers.size()) {
+                std::cout << ", next layer sparse batches "
+                          << std::setprecision(1)
+                          << layers[i + 1].getSparseInputFraction() * 100.0
+                          << "%";
+            }
+            std::cout << "\n";
+        }
+        std::cout << "Input sparse batches: " << std::fixed
+                  << std::setprecision(1)
+                  << layers[0].getSparseInputFraction() * 100.0 << "%\n";
+        std::cout << "==============================\n\n";
+    }
+
+    size_t parameterCount() const {
+        return parameters->size();
+    }
+
+    size_t layerCount() const {
+        return layers.size();
+    }
+
+    // Copies of a layer own their parameters; see Layer::shareParameters().
+    const Layer &getLayer(size_t i) const {
+        return layers[i];
+    }
+
+    // The whole model as one flat vector (cache-line padding between views
+    // included), for single-pass updates, norms and averaging.
+    Map<VectorXd> parameterVector() {
+        flushPendingDecay();
+        unfreeze();
+        return Map<VectorXd>(parameters->data(), parameters->size());
+    }
+
+    Map<VectorXd> gradientVector() {
+        return Map<VectorXd>(gradients->data(), gradients->size());
+    }
+
+    void flushPendingDecay() {
+        for (Layer &layer : layers) {
+            layer.flushPendingDecay();
+        }
+    }
+
+    std::vector<double> snapshotParameters() {
+        flushPendingDecay();
+        std::vector<double> snapshot(parameters->size());
+        std::memcpy(snapshot.data(), parameters->data(),
+                    snapshot.size() * sizeof(double));
+        return snapshot;
+    }
+
+    void restoreParameters(const std::vector<double> &snapshot) {
+        eigen_assert(snapshot.size() == parameters->size());
+        flushPendingDecay();
+        unfreeze();
+        std::memcpy(parameters->data(), snapshot.data(),
+                    snapshot.size() * sizeof(double));
+    }
+
+    // A copy sharing this network's parameter and gradient buffers, e.g. for
+    // the replicas of a parallel trainer, which split them off again with
+    // detachGradients() or detachParameters().
+    Network replica() const {
+        Network copy(*this);
+        copy.parameters = parameters;
+        copy.gradients = gradients;
+        for (size_t i = 0; i < layers.size(); i++) {
+            copy.layers[i].shareParameters(layers[i]);
+        }
+        return copy;
+    }
+
+    // Gives this network a zeroed gradient buffer of its own while it keeps
+    // sharing the parameters, e.g. for a data-parallel replica.
+    void detachGradients() {
+        gradients = std::make_shared<AlignedBuffer>(parameters->size());
+        size_t offset = 0;
+        for (Layer &layer : layers) {
+            layer.bindGradients(gradients, offset);
+            offset += Layer::parameterCount(layer.inputs(), layer.outputs());
+        }
+    }
+
+    // Gives this network parameters and gradients of its own, starting as a
+    // copy of the shared ones, e.g. for a replica that trains on its own.
+    void detachParameters() {
+        flattenParameters();
+    }
+
+    // After gradients of other replicas were summed into this network's.
+    void markGradientsDense() {
+        for (Layer &layer : layers) {
+            layer.markGradientDense();
+        }
+    }
+
+    // Copies the weight-decay scales of a network sharing these parameters.
+    void syncWeightScales(const Network &source) {
+        for (size_t i = 0; i < layers.size(); i++) {
+            layers[i].setWeightScale(source.layers[i].getWeightScale());
+        }
+    }
+
+    // Moves parameters, gradients and per-batch activation buffers into
+    // 2MB-page backed arena slabs (or back onto the regular heap for OFF).
+    void setHugePages(HugePages mode) {
+        HugePageArena::instance().setMode(mode);
+        flattenParameters();
+        for (Layer &layer : layers) {
+            layer.reallocateBuffers();
+        }
+    }
+
+    // Reallocates parameters, gradients, workspaces and per-batch buffers
+    // on node, e.g. for a network used only by threads bound there. The
+    // network gets parameter buffers of its own; replicas sharing the old
+    // ones keep them.
+    void bindToNode(int node) {
+        memoryNode = node;
+        flattenParameters();
+        unplaceLayers();
+        trainingWorkspace.buffer.reset();
+        inferenceWorkspace.buffer.reset();
+        for (Layer &layer : layers) {
+            layer.bindBuffersToNode(node);
+        }
+    }
+
+    // Node backing the first page of each buffer (-1: not touched yet).
+    void printNumaPlacement() const {
+        std::cout << "\n===== NUMA PLACEMENT (" << Numa::nodeCount()
+                  << " nodes, caller on node " << Numa::currentNode()
+                  << ") =====\n";
+        std::cout << "Parameters: node " << Numa::nodeOfAddress(parameters->data())
+                  << "\n";
+        std::cout << "Gradients: node " << Numa::nodeOfAddress(gradients->data())
+                  << "\n";
+        for (size_t i = 0; i < layers.size(); i++) {
+            std::cout << "Layer " << i << " activations: node "
+                      << Numa::nodeOfAddress(layers[i].activationData())
+                      << "\n";
+        }
+        std::cout << "========================================\n\n";
+    }
+
+    // Runs the same training steps with each huge-page mode and prints
+    // step time and data-TLB load misses. Parameters are restored
+    // between runs and afterwards.
+    void compareHugePages(const std::vector<VectorXd> &data,
+                          const std::vector<VectorXd> &labels, int batchSize,
+                          int steps = 200, double lr = 0.001) {
+        typedef std::chrono::steady_clock Clock;
+        HugePages original = HugePageArena::instance().mode();
+        std::vector<double> snapshot = snapshotParameters();
+        auto batches = sampleBatches(data, labels, batchSize, steps);
+        const HugePages modes[] = {HugePages::OFF, HugePages::TRANSPARENT,
+                                   HugePages::EXPLICIT};
+        const char *names[] = {"OFF", "TRANSPARENT", "EXPLICIT"};
+
+        std::cout << "\n===== HUGE PAGES (batch " << batchSize << ", "
+                  << steps << " steps) =====\n";
+        for (int m = 0; m < 3; m++) {
+            setHugePages(modes[m]);
+            restoreParameters(snapshot);
+            for (int i = 0; i < std::min(steps, 5); i++) {
+                forward(batches[i].first);
+                backward(batches[i].first, batches[i].second, lr);
+            }
+            restoreParameters(snapshot);
+
+            TlbMissCounter tlbMisses;
+            tlbMisses.start();
+            auto start = Clock::now();
+            for (const auto &batch : batches) {
+                forward(batch.first);
+                backward(batch.first, batch.second, lr);
+            }
+            double us = std::chrono::duration<double, std::micro>(
+                            Clock::now() - start)
+                            .count();
+            long long misses = tlbMisses.stop();
+
+            std::cout << std::left << std::setw(12) << names[m] << std::right
+                      << std::fixed << std::setprecision(1) << us / steps
+                      << " us/step, dTLB load misses: ";
+            if (misses >= 0) {
+                std::cout << misses / steps << "/step";
+            } else {
+                std::cout << "n/a";
+            }
+            std::cout << "\n";
+        }
+        if (HugePageArena::instance().explicitPageFallbacks() > 0) {
+            std::cout << "EXPLICIT fell back to transparent pages (no "
+                         "reserved hugetlb pages)\n";
+        }
+        std::cout << "=========================================\n\n";
+        setHugePages(original);
+        restoreParameters(snapshot);
+    }
+
+    // Packs every layer's weights once for inference and snapshots the run
+    // of small trailing layers into a fused kernel; any weight update drops
+    // both again.
+    void freeze() {
+        for (Layer &layer : layers) {
+            layer.freeze();
+        }
+        buildFusedTail();
+    }
+
+    void unfreeze() {
+        for (Layer &layer : layers) {
+            layer.unfreeze();
+        }
+        fusedTail.clear();
+        fusedFrom = layers.size();
+    }
+
+    void setFusedMaxWidth(int width) {
+        fusedMaxWidth = width;
+    }
+
+    // Inference-only forward pass that returns the network output. Once
+    // frozen, the small trailing layers run through the fused kernel and do
+    // not leave per-layer activations behind.
+    MatrixXd infer(const MatrixXd &batchInput) {
+        placeInferenceBuffers(batchInput.cols());
+        if (fusedTail.empty()) {
+            layers[0].forward(batchInput);
+            for (size_t i = 1; i < layers.size(); i++) {
+                layers[i].forward(layers[i - 1].getActivations());
+            }
+            return layers.back().getActivations();
+        }
+        for (size_t i = 0; i < fusedFrom; i++) {
+            layers[i].forward(i == 0 ? batchInput
+                                     : layers[i - 1].getActivations());
+        }
+        if (fusedFrom == 0) {
+            return fusedTail.forward(batchInput);
+        }
+        return fusedTail.forward(layers[fusedFrom - 1].getActivations());
     }
 
     void forward(const MatrixXd &batchInput) {
-        layers[0].forward(batchInput);
-        for (size_t i = 1; i < layers.size(); i++) {
-            layers[i].forward(layers[i - 1].getActivations());
+        placeTrainingBuffers(batchInput.cols());
+        const bool trackDensity =
+            activationStats || activationSparsityThreshold > 0.0;
+        size_t fullBytes = 0;
+        for (size_t i = 0; i < layers.size(); i++) {
+            if (i == 0) {
+                layers[i].forward(batchInput);
+            } else {
+                layers[i].forward(layers[i - 1].getActivations());
+                retireActivations(i - 1);
+            }
+            if (trackDensity) {
+                activationDensitySum[i] += layers[i].getActivationDensity();
+            }
+            fullBytes += layers[i].activationBytes();
+            forwardFlops += layerFlops(i, batchInput.cols());
         }
+        densityBatches += trackDensity;
+        peakFullActivationBytes = std::max(peakFullActivationBytes, fullBytes);
+        peakActivationBytes =
+            std::max(peakActivationBytes, liveActivationBytes());
     }
 
-    void backward(const MatrixXd &batchInput, const MatrixXd &batchTarget,
-                  double lr) {
+    MatrixXd getOutput() const {
+        return layers.back().getActivations();
+    }
+
+    // Backpropagates the last forward pass and writes every layer's
+    // gradients, or adds them to the gradients of the micro-batches
+    // computed since the last step(). Parameters stay untouched. weight
+    // scales this micro-batch's gradients, e.g. by its share of a batch
+    // split unevenly.
+    void computeGradients(const MatrixXd &batchInput,
+                          const MatrixXd &batchTarget, double weight = 1.0) {
+        bool accumulate = accumulatedBatches > 0;
         MatrixXd output = layers.back().getActivations();
 
         MatrixXd delta;
@@ -38,31 +765,241 @@ class Network {
             delta = error.cwiseProduct(
                 layers.back().getActivationDerivative(output));
         }
+        // Backward is linear in the output error.
+        if (weight != 1.0) {
+            delta *= weight;
+        }
 
         layers.back().setDelta(delta);
 
+        // Each layer's gradients are taken right after the error below it,
+        // so checkpointed segments can be dropped as soon as backward has
+        // passed them.
         for (int i = layers.size() - 2; i >= 0; i--) {
-            MatrixXd nextWeights = layers[i + 1].getWeights();
-            MatrixXd nextDelta = layers[i + 1].getDelta();
+            if (!layers[i].hasActivations()) {
+                recomputeSegment(i, batchInput);
+            }
+            MatrixXd hiddenOutput = layers[i].getActivations();
 
-            MatrixXd hiddenError = nextWeights * nextDelta;
+            MatrixXd hiddenError;
+            if (layers[i].getActivationType() == ActivationType::RELU &&
+                layers[i + 1].usedSparseInput()) {
+                hiddenError = layers[i + 1].sparseInputError(hiddenOutput);
+            } else {
+                hiddenError = layers[i + 1].inputError();
+            }
 
-            MatrixXd hiddenOutput = layers[i].getActivations();
-            MatrixXd hiddenDelta = hiddenError.cwiseProduct(
-                layers[i].getActivationDerivative(hiddenOutput));
+            MatrixXd hiddenDelta =
+                hiddenError.cwiseProduct(layers[i].activationDerivative());
 
             layers[i].setDelta(hiddenDelta);
+
+            layers[i + 1].computeGradients(hiddenOutput, accumulate);
+            if (gradientHook) {
+                gradientHook(i + 1);
+            }
+            if (!keepsActivations(i + 1)) {
+                layers[i + 1].releaseActivations();
+            }
         }
 
-        for (size_t i = 0; i < layers.size(); i++) {
-            MatrixXd layerInput;
-            if (i == 0) {
-                layerInput = batchInput;
+        layers[0].computeGradients(batchInput, accumulate);
+        if (gradientHook) {
+            gradientHook(0);
+        }
+        if (!keepsActivations(0)) {
+            layers[0].releaseActivations();
+        }
+        accumulatedBatches++;
+    }
+
+    // Applies the gradients accumulated since the last step with optimizer
+    // and starts a new accumulation.
+    void step(Optimizer &optimizer) {
+        if (accumulatedBatches == 0) {
+            return;
+        }
+        double scale = 1.0 / accumulatedBatches;
+        accumulatedBatches = 0;
+        if (maxGradientNorm > 0.0 || skipNonFinite) {
+            // One read of the flat gradient buffer: a NaN or Inf anywhere
+            // makes the squared norm non-finite as well.
+            double squaredNorm = gradientVector().squaredNorm();
+            if (gradientNormReduction) {
+                squaredNorm = gradientNormReduction(squaredNorm);
+            }
+            lastGradientNorm = scale * std::sqrt(squaredNorm);
+            if (!std::isfinite(lastGradientNorm)) {
+                if (skipNonFinite) {
+                    skippedSteps++;
+                    return;
+                }
+            } else if (maxGradientNorm > 0.0 &&
+                       lastGradientNorm > maxGradientNorm) {
+                scale *= maxGradientNorm / lastGradientNorm;
+                clippedSteps++;
+            }
+        }
+        unfreeze();
+        optimizer.step(layers, scale);
+    }
+
+    // Called with i as soon as computeGradients() has written layer i's
+    // gradients (last layer first), e.g. to start communicating them while
+    // the layers below are still in backward.
+    void setGradientHook(std::function<void(size_t)> hook) {
+        gradientHook = std::move(hook);
+    }
+
+    // Maps the squared norm of this network's gradient buffer to that of
+    // the whole gradient in step(), e.g. summing over ranks that each hold
+    // a shard of it, so clipping and the non-finite check agree everywhere.
+    void setGradientNormReduction(std::function<double(double)> reduce) {
+        gradientNormReduction = std::move(reduce);
+    }
+
+    // Records that the gradients of batches micro-batches were written into
+    // the gradient buffers from outside computeGradients(), e.g. by a
+    // pipeline executor driving copies of the layers.
+    void markGradientsAccumulated(int batches) {
+        accumulatedBatches += batches;
+    }
+
+    // Drops the gradients accumulated since the last step without applying
+    // them; the next computeGradients() overwrites the buffers.
+    void discardGradients() {
+        accumulatedBatches = 0;
+    }
+
+    // maxNorm 0 disables clipping; the norm is still computed for the
+    // non-finite guard unless that is off too.
+    void setGradientClipping(double maxNorm, bool skipNonFiniteSteps = true) {
+        maxGradientNorm = maxNorm;
+        skipNonFinite = skipNonFiniteSteps;
+    }
+
+    double getLastGradientNorm() const {
+        return lastGradientNorm;
+    }
+
+    long getClippedSteps() const {
+        return clippedSteps;
+    }
+
+    long getSkippedSteps() const {
+        return skippedSteps;
+    }
+
+    void backward(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                  double lr) {
+        computeGradients(batchInput, batchTarget);
+        sgd.setLearningRate(lr);
+        step(sgd);
+    }
+
+    // train() splits every batch into this many micro-batches and steps
+    // once per batch, so activation memory scales with the micro-batch.
+    void setGradientAccumulation(int microBatches) {
+        accumulationSteps = std::max(1, microBatches);
+    }
+
+    // Forward and gradients for batch in accumulationSteps micro-batches,
+    // then one optimizer step. Returns the loss over the batch.
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      Optimizer &optimizer) {
+        if (accumulationSteps == 1) {
+            forward(batchInput);
+            double loss = MSE(batchTarget, layers.back().getActivations());
+            computeGradients(batchInput, batchTarget);
+            step(optimizer);
+            return loss;
+        }
+        // Micro-batch sizes differ by at most one column; each is weighted
+        // by its share of the batch, so step() ends with the batch mean.
+        Index cols = batchInput.cols();
+        int microBatches = std::min<Index>(accumulationSteps, cols);
+        double loss = 0.0;
+        for (int m = 0; m < microBatches; m++) {
+            Index begin = cols * m / microBatches;
+            Index n = cols * (m + 1) / microBatches - begin;
+            MatrixXd microInput = batchInput.middleCols(begin, n);
+            MatrixXd microTarget = batchTarget.middleCols(begin, n);
+            forward(microInput);
+            loss += MSE(microTarget, layers.back().getActivations()) * n;
+            computeGradients(microInput, microTarget,
+                             (double)microBatches * n / cols);
+        }
+        step(optimizer);
+        return loss / cols;
+    }
+
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      double lr) {
+        sgd.setLearningRate(lr);
+        return trainBatch(batchInput, batchTarget, sgd);
+    }
+
+    // Trains from the same initial parameters and sample order with each
+    // optimizer until the test accuracy reaches targetAccuracy (checked
+    // after every epoch) and prints epochs and training time to get there.
+    // The initial parameters are restored afterwards.
+    void compareTimeToAccuracy(
+        const std::vector<std::pair<std::string, Optimizer *>> &optimizers,
+        const std::vector<VectorXd> &data, const std::vector<VectorXd> &labels,
+        const std::vector<VectorXd> &testData,
+        const std::vector<VectorXd> &testLabels, int batchSize,
+        double targetAccuracy, int maxEpochs = 10) {
+        typedef std::chrono::steady_clock Clock;
+        std::vector<double> initial = snapshotParameters();
+        int numBatches = data.size() / batchSize;
+
+        std::cout << "\n===== TIME TO " << std::fixed << std::setprecision(1)
+                  << targetAccuracy << "% TEST ACCURACY =====\n";
+        for (const auto &entry : optimizers) {
+            restoreParameters(initial);
+            std::vector<int> indices(data.size());
+            for (size_t i = 0; i < indices.size(); i++) {
+                indices[i] = i;
+            }
+            std::mt19937 g(42);
+
+            double seconds = 0.0;
+            double accuracy = 0.0;
+            int epoch = 0;
+            while (epoch < maxEpochs && accuracy < targetAccuracy) {
+                std::shuffle(indices.begin(), indices.end(), g);
+                auto start = Clock::now();
+                for (int batch = 0; batch < numBatches; batch++) {
+                    MatrixXd batchInput(data[0].size(), batchSize);
+                    MatrixXd batchTarget(labels[0].size(), batchSize);
+                    for (int i = 0; i < batchSize; i++) {
+                        int idx = indices[batch * batchSize + i];
+                        batchInput.col(i) = data[idx];
+                        batchTarget.col(i) = labels[idx];
+                    }
+                    trainBatch(batchInput, batchTarget, *entry.second);
+                }
+                seconds +=
+                    std::chrono::duration<double>(Clock::now() - start)
+                        .count();
+                epoch++;
+                accuracy = test(testData, testLabels, true);
+            }
+
+            std::cout << std::left << std::setw(10) << entry.first
+                      << std::right;
+            if (accuracy >= targetAccuracy) {
+                std::cout << epoch << " epochs, " << std::setprecision(2)
+                          << seconds << " s";
             } else {
-                layerInput = layers[i - 1].getActivations();
+                std::cout << "not reached in " << maxEpochs << " epochs ("
+                          << std::setprecision(2) << accuracy << "%, "
+                          << seconds << " s)";
             }
-            layers[i].updateWeights(layerInput, lr);
+            std::cout << "\n";
         }
+        std::cout << "============================================\n\n";
+        restoreParameters(initial);
     }
 
     void train(const std::vector<VectorXd> &data,
@@ -147,12 +1084,7 @@ class Network {
                     batchTarget.col(i) = labels[idx];
                 }
 
-                forward(batchInput);
-
-                MatrixXd output = layers.back().getActivations();
-                totalLoss += MSE(batchTarget, output);
-
-                backward(batchInput, batchTarget, lr);
+                totalLoss += trainBatch(batchInput, batchTarget, lr);
 
                 if (batch % progressStep == 0 || batch == numBatches - 1) {
                     int progress = (batch + 1) * 100 / numBatches;
@@ -219,6 +1151,8 @@ class Network {
                   << bestLoss << "\n";
         std::cout << "Best validation accuracy: " << std::fixed
                   << std::setprecision(2) << bestAccuracy << "%\n";
+        std::cout << "Clipped steps: " << clippedSteps
+                  << ", skipped (non-finite) steps: " << skippedSteps << "\n";
         std::cout << "==============================\n\n";
     }
 
@@ -242,13 +1176,12 @@ class Network {
             MatrixXd input(data[i].size(), 1);
             input.col(0) = data[i];
 
-            forward(input);
-
-            VectorXd output = layers.back().getActivations().col(0);
+            MatrixXd outputMat = infer(input);
+            VectorXd output = outputMat.col(0);
 
             MatrixXd target(labels[i].size(), 1);
             target.col(0) = labels[i];
-            totalLoss += MSE(target, layers.back().getActivations());
+            totalLoss += MSE(target, outputMat);
 
             int predicted = 0;
             double maxVal = output(0);
@@ -306,4 +1239,102 @@ class Network {
 
         return accuracy;
     }
-};
\ No newline at end of file
+
+    // Times frozen inference on batches drawn from data, once layer by layer
+    // and once with the small trailing layers fused, and prints per-layer
+    // latencies next to the fused tail.
+    void compareInferenceLatency(const std::vector<VectorXd> &data,
+                                 int batchSize, int repeats = 50) {
+        freeze();
+        if (fusedTail.empty()) {
+            std::cout << "No fusable trailing layers (max width "
+                      << fusedMaxWidth << ")\n";
+            return;
+        }
+
+        int numBatches = std::max(1, (int)data.size() / batchSize);
+        numBatches = std::min(numBatches, 64);
+        std::vector<MatrixXd> batches;
+        for (int b = 0; b < numBatches; b++) {
+            MatrixXd batch(data[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                batch.col(i) = data[(b * batchSize + i) % data.size()];
+            }
+            batches.push_back(batch);
+        }
+
+        typedef std::chrono::steady_clock Clock;
+        std::vector<double> layerTimes(layers.size(), 0.0);
+        for (int r = 0; r < repeats; r++) {
+            for (const MatrixXd &batch : batches) {
+                for (size_t i = 0; i < layers.size(); i++) {
+                    auto start = Clock::now();
+                    layers[i].forward(i == 0 ? batch
+                                             : layers[i - 1].getActivations());
+                    layerTimes[i] +=
+                        std::chrono::duration<double, std::micro>(
+                            Clock::now() - start)
+                            .count();
+                }
+            }
+        }
+
+        double fusedTime = 0.0;
+        double maxDiff = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            for (const MatrixXd &batch : batches) {
+                for (size_t i = 0; i < fusedFrom; i++) {
+                    layers[i].forward(i == 0 ? batch
+                                             : layers[i - 1].getActivations());
+                }
+                const MatrixXd &tailInput =
+                    fusedFrom == 0 ? batch
+                                   : layers[fusedFrom - 1].getActivations();
+                auto start = Clock::now();
+                MatrixXd output = fusedTail.forward(tailInput);
+                fusedTime += std::chrono::duration<double, std::micro>(
+                                 Clock::now() - start)
+                                 .count();
+                if (r == 0) {
+                    forward(batch);
+                    maxDiff = std::max(
+                        maxDiff, (output - layers.back().getActivations())
+                                     .cwiseAbs()
+                                     .maxCoeff());
+                }
+            }
+        }
+
+        double calls = (double)repeats * numBatches;
+        double tailTime = 0.0;
+        double headTime = 0.0;
+        std::cout << "\n===== INFERENCE LATENCY (batch " << batchSize
+                  << ") =====\n";
+        for (size_t i = 0; i < layers.size(); i++) {
+            std::cout << "Layer " << i << " (" << layers[i].getWeights().rows()
+                      << " -> " << layers[i].getWeights().cols()
+                      << "): " << std::fixed << std::setprecision(2)
+                      << layerTimes[i] / calls << " us"
+                      << (i >= fusedFrom ? " [fused]" : "") << "\n";
+            if (i >= fusedFrom) {
+                tailTime += layerTimes[i];
+            } else {
+                headTime += layerTimes[i];
+            }
+        }
+        std::cout << "Per-layer tail: " << std::fixed << std::setprecision(2)
+                  << tailTime / calls << " us\n";
+        std::cout << "Fused tail: " << fusedTime / calls << " us ("
+                  << tailTime / fusedTime << "x)\n";
+        std::cout << "End to end: " << (headTime + tailTime) / calls
+                  << " us per-layer vs " << (headTime + fusedTime) / calls
+                  << " us fused\n";
+        std::cout << "Max output difference: " << std::scientific
+                  << std::setprecision(2) << maxDiff << "\n";
+        std::cout << "=================================\n\n";
+    }
+};
+
+// Replica vectors must relocate networks without deep copies.
+static_assert(std::is_nothrow_move_constructible<Network>::value,
+              "Network moves must not throw");
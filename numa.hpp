@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// NUMA topology from sysfs plus thread pinning and page placement through
+// the raw sched_setaffinity/set_mempolicy/mbind syscalls, so nothing beyond
+// the kernel headers is needed. On single-node hosts every call is a cheap
+// no-op that reports node 0.
+class Numa {
+  private:
+    static std::vector<int> parseList(const std::string &list) {
+        std::vector<int> values;
+        std::stringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            if (range.empty()) {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos
+                           ? first
+                           : std::stoi(range.substr(dash + 1));
+            for (int v = first; v <= last; v++) {
+                values.push_back(v);
+            }
+        }
+        return values;
+    }
+
+    static std::string readLine(const std::string &path) {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    static std::vector<unsigned long> nodeMask(int node) {
+        const int bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(node / bits + 1, 0);
+        mask[node / bits] |= 1UL << (node % bits);
+        return mask;
+    }
+
+  public:
+    static std::vector<int> nodes() {
+        std::vector<int> online =
+            parseList(readLine("/sys/devices/system/node/online"));
+        if (online.empty()) {
+            online.push_back(0);
+        }
+        return online;
+    }
+
+    static int nodeCount() {
+        return nodes().size();
+    }
+
+    static std::vector<int> cpusOfNode(int node) {
+        std::vector<int> cpus = parseList(readLine(
+            "/sys/devices/system/node/node" + std::to_string(node) +
+            "/cpulist"));
+        if (cpus.empty()) {
+            for (unsigned c = 0; c < std::thread::hardware_concurrency();
+                 c++) {
+                cpus.push_back(c);
+            }
+        }
+        return cpus;
+    }
+
+    static int nodeOfCpu(int cpu) {
+        for (int node : nodes()) {
+            for (int c : cpusOfNode(node)) {
+                if (c == cpu) {
+                    return node;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // CPUs in the calling thread's affinity mask, taking one from each node
+    // in turn so that a prefix of the list spreads over the nodes.
+    static std::vector<int> allowedCpus() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            return {};
+        }
+        std::vector<std::vector<int>> perNode;
+        size_t longest = 0;
+        for (int node : nodes()) {
+            std::vector<int> cpus;
+            for (int cpu : cpusOfNode(node)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            longest = std::max(longest, cpus.size());
+            perNode.push_back(cpus);
+        }
+        std::vector<int> allowed;
+        for (size_t i = 0; i < longest; i++) {
+            for (const std::vector<int> &cpus : perNode) {
+                if (i < cpus.size()) {
+                    allowed.push_back(cpus[i]);
+                }
+            }
+        }
+        return allowed;
+    }
+
+    // Node that serves thread i when threads are spread round-robin.
+    static int nodeForThread(int thread) {
+        std::vector<int> online = nodes();
+        return online[thread % online.size()];
+    }
+
+    // Node the calling thread is running on.
+    static int currentNode() {
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+            return 0;
+        }
+        return node;
+    }
+
+    // Node backing the page at addr, or -1 if it has not been touched yet.
+    static int nodeOfAddress(const void *addr) {
+        int node = -1;
+        if (syscall(SYS_get_mempolicy, &node, nullptr, 0,
+                    const_cast<void *>(addr),
+                    MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+            return -1;
+        }
+        return node;
+    }
+
+    // Restricts the calling thread to the CPUs of node.
+    static bool pinThreadToNode(int node) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpusOfNode(node)) {
+            CPU_SET(cpu, &set);
+        }
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    static bool pinThreadToCpu(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    // Pages the calling thread touches first from now on come from node
+    // while it has free memory.
+    static bool preferNode(int node) {
+        std::vector<unsigned long> mask = nodeMask(node);
+        return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(),
+                       mask.size() * 8 * sizeof(unsigned long) + 1) == 0;
+    }
+
+    // Pins the calling thread to node and makes node its preferred memory,
+    // so buffers it allocates and first touches are local.
+    static bool bindThread(int node) {
+        bool pinned = pinThreadToNode(node);
+        bool preferred = preferNode(node);
+        return pinned && preferred;
+    }
+
+    // Binds the pages of [addr, addr + bytes) to node and migrates the
+    // ones already faulted in elsewhere. addr must start a page of a
+    // mapping the caller owns outright (e.g. its own mmap): the policy
+    // applies to whole pages and stays with them until they are unmapped,
+    // so it must not reach heap pages shared with other allocations.
+    static bool bindMemory(const void *addr, size_t bytes, int node) {
+        if (addr == nullptr || bytes == 0) {
+            return true;
+        }
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+        if (begin % page != 0) {
+            return false;
+        }
+        std::vector<unsigned long> mask = nodeMask(node);
+        return syscall(SYS_mbind, begin, bytes, MPOL_BIND, mask.data(),
+                       mask.size() * 8 * sizeof(unsigned long) + 1,
+                       MPOL_MF_MOVE) == 0;
+    }
+
+    // Runs fn on a thread bound to node and waits for it, e.g. to build a
+    // data structure whose allocations should be local to that node.
+    template <typename Fn>
+    static void runOnNode(int node, Fn fn) {
+        std::thread worker([&]() {
+            bindThread(node);
+            fn();
+        });
+        worker.join();
+    }
+};
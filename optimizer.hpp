@@ -0,0 +1,367 @@
+#pragma once
+
+#include "layer.hpp"
+#include "pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Applies the gradients held by a network's layers to their parameters.
+// The gradients are the sum of the mean gradients of every micro-batch
+// accumulated since the last step; gradientScale (one over their count)
+// turns that into the average.
+class Optimizer {
+  protected:
+    double learningRate;
+
+  public:
+    explicit Optimizer(double learningRate) : learningRate(learningRate) {}
+
+    virtual ~Optimizer() = default;
+
+    void setLearningRate(double lr) {
+        learningRate = lr;
+    }
+
+    double getLearningRate() const {
+        return learningRate;
+    }
+
+    virtual void step(std::vector<Layer> &layers, double gradientScale) = 0;
+};
+
+// SGD with L2 weight decay. The decay goes into the layer's weight scale,
+// so a step reads and writes each weight once (only the rows with
+// gradient under a sparse weight gradient) and never multiplies the whole
+// matrix by the decay factor. A positive clipThreshold also clamps every
+// gradient element (dropping NaNs) in a scalar loop; the network's
+// global-norm clipping is usually the better choice.
+class SGD : public Optimizer {
+  private:
+    double weightDecay;
+    double clipThreshold;
+
+    double clip(double g) const {
+        if (std::isnan(g)) {
+            return 0.0;
+        }
+        return std::max(-clipThreshold, std::min(clipThreshold, g));
+    }
+
+    // With effective weights s * W, the step s * W * (1 - lr * wd) - lr * g
+    // is the new scale s' = s * (1 - lr * wd) and W -= (lr / s') * g.
+    void stepLayer(Layer &layer, double scale) {
+        Map<VectorXd> &biases = layer.biasesView();
+        const Map<VectorXd> &biasGradient = layer.biasGradientView();
+        if (clipThreshold > 0.0) {
+            for (Index j = 0; j < biases.size(); j++) {
+                biases(j) -= learningRate * clip(scale * biasGradient(j));
+            }
+        } else {
+            biases -= learningRate * scale * biasGradient;
+        }
+
+        layer.decayWeights(1.0 - learningRate * weightDecay);
+        double stepSize = learningRate / layer.getWeightScale();
+        Map<RowMatrixXd> &weights = layer.weightsView();
+        const Map<RowMatrixXd> &weightGradient = layer.weightGradientView();
+        if (!layer.hasSparseGradient()) {
+            if (clipThreshold > 0.0) {
+                for (Index k = 0; k < weights.rows(); k++) {
+                    updateRow(weights, weightGradient, k, scale, stepSize);
+                }
+            } else {
+                weights -= (stepSize * scale) * weightGradient;
+            }
+            return;
+        }
+        for (int k : layer.getGradientRows()) {
+            updateRow(weights, weightGradient, k, scale, stepSize);
+        }
+    }
+
+    void updateRow(Map<RowMatrixXd> &weights,
+                   const Map<RowMatrixXd> &weightGradient, Index k,
+                   double scale, double stepSize) {
+        if (clipThreshold <= 0.0) {
+            weights.row(k) -= (stepSize * scale) * weightGradient.row(k);
+            return;
+        }
+        for (Index j = 0; j < weights.cols(); j++) {
+            weights(k, j) -= stepSize * clip(scale * weightGradient(k, j));
+        }
+    }
+
+  public:
+    SGD(double learningRate = 0.001, double weightDecay = 0.0001,
+        double clipThreshold = 0.0)
+        : Optimizer(learningRate), weightDecay(weightDecay),
+          clipThreshold(clipThreshold) {}
+
+    void step(std::vector<Layer> &layers, double gradientScale) override {
+        for (Layer &layer : layers) {
+            stepLayer(layer, gradientScale);
+        }
+    }
+};
+
+// Precision of the per-parameter optimizer state. HALF has a narrow range,
+// so Adam's second moment underflows for small gradients; BFLOAT16 keeps
+// the range of float at lower resolution.
+enum class StatePrecision {
+    DOUBLE,
+    FLOAT,
+    HALF,
+    BFLOAT16
+};
+
+// Base for optimizers that update every parameter from its gradient and
+// per-parameter state in one pass. Each layer contributes two contiguous
+// spans (weights, biases); Derived::update<S>(p, g, s0, s1, n, scale) runs
+// over a span with state of scalar type S in L1-sized blocks of Eigen array
+// expressions, so every array is read and written once and the arithmetic
+// is vectorized. With several threads the spans are split into equal
+// element ranges over a pool the optimizer keeps between steps. With a
+// shard set, only the elements [begin, end) of that order are updated and
+// only their state is allocated.
+template <typename Derived>
+class FusedOptimizer : public Optimizer {
+  private:
+    struct Span {
+        double *parameters;
+        const double *gradients;
+        size_t offset;
+        size_t size;
+    };
+
+    StatePrecision precision = StatePrecision::DOUBLE;
+    std::vector<unsigned char, aligned_allocator<unsigned char>> state;
+    size_t stateCount = 0;
+    size_t shardBegin = 0;
+    size_t shardEnd = SIZE_MAX;
+    std::unique_ptr<WorkerPool> pool;
+
+    size_t stateBytes() const {
+        switch (precision) {
+        case StatePrecision::FLOAT:
+            return sizeof(float);
+        case StatePrecision::HALF:
+        case StatePrecision::BFLOAT16:
+            return 2;
+        case StatePrecision::DOUBLE:
+        default:
+            return sizeof(double);
+        }
+    }
+
+    template <typename S>
+    void run(const std::vector<Span> &spans, size_t begin, size_t end,
+             double scale) {
+        S *s0 = reinterpret_cast<S *>(state.data());
+        S *s1 = s0 + stateCount;
+        const Derived &self = static_cast<const Derived &>(*this);
+        for (const Span &span : spans) {
+            size_t from = std::max(begin, span.offset);
+            size_t to = std::min(end, span.offset + span.size);
+            if (from >= to) {
+                continue;
+            }
+            size_t local = from - span.offset;
+            self.update(span.parameters + local, span.gradients + local,
+                        s0 + (from - shardBegin), s1 + (from - shardBegin),
+                        to - from, scale);
+        }
+    }
+
+    void runRange(const std::vector<Span> &spans, size_t begin, size_t end,
+                  double scale) {
+        switch (precision) {
+        case StatePrecision::FLOAT:
+            run<float>(spans, begin, end, scale);
+            break;
+        case StatePrecision::HALF:
+            run<half>(spans, begin, end, scale);
+            break;
+        case StatePrecision::BFLOAT16:
+            run<bfloat16>(spans, begin, end, scale);
+            break;
+        case StatePrecision::DOUBLE:
+        default:
+            run<double>(spans, begin, end, scale);
+            break;
+        }
+    }
+
+  protected:
+    static const int block = 256;
+    typedef Array<double, Dynamic, 1, 0, block, 1> Block;
+
+    // Called once per step before the kernels run.
+    virtual void beginStep() {}
+
+  public:
+    explicit FusedOptimizer(double learningRate) : Optimizer(learningRate) {}
+
+    // Changing the precision drops the accumulated state.
+    void setStatePrecision(StatePrecision p) {
+        precision = p;
+        state.clear();
+        stateCount = 0;
+    }
+
+    StatePrecision getStatePrecision() const {
+        return precision;
+    }
+
+    // Restricts steps to the elements [begin, end) of the weights-then-
+    // biases order over all layers; other parameters are left untouched.
+    // Drops the accumulated state.
+    void setShard(size_t begin, size_t end) {
+        shardBegin = begin;
+        shardEnd = std::max(begin, end);
+        state.clear();
+        stateCount = 0;
+    }
+
+    void setThreads(int n) {
+        n = std::max(1, n);
+        if (n == 1) {
+            pool.reset();
+        } else if (!pool || pool->size() != n) {
+            pool.reset(new WorkerPool(n));
+        }
+    }
+
+    size_t stateMemoryBytes() const {
+        return state.size();
+    }
+
+    void step(std::vector<Layer> &layers, double gradientScale) override {
+        std::vector<Span> spans;
+        size_t total = 0;
+        for (Layer &layer : layers) {
+            layer.flushPendingDecay();
+            Map<RowMatrixXd> &weights = layer.weightsView();
+            Map<VectorXd> &biases = layer.biasesView();
+            spans.push_back({weights.data(), layer.weightGradientView().data(),
+                             total, (size_t)weights.size()});
+            total += weights.size();
+            spans.push_back({biases.data(), layer.biasGradientView().data(),
+                             total, (size_t)biases.size()});
+            total += biases.size();
+        }
+        const size_t first = std::min(shardBegin, total);
+        const size_t last = std::min(shardEnd, total);
+        if (stateCount != last - first) {
+            stateCount = last - first;
+            state.assign(2 * stateCount * stateBytes(), 0);
+        }
+        beginStep();
+
+        if (!pool) {
+            runRange(spans, first, last, gradientScale);
+            return;
+        }
+        size_t chunk = (stateCount + pool->size() - 1) / pool->size();
+        pool->run([&](int t) {
+            size_t begin = std::min(last, first + t * chunk);
+            size_t end = std::min(last, begin + chunk);
+            runRange(spans, begin, end, gradientScale);
+        });
+    }
+};
+
+// SGD with momentum: v = mu * v + g, then p -= lr * v, or with Nesterov
+// p -= lr * (g + mu * v). g includes the L2 term weightDecay * p.
+class Momentum : public FusedOptimizer<Momentum> {
+  private:
+    double momentum;
+    double weightDecay;
+    bool nesterov;
+
+  public:
+    Momentum(double learningRate = 0.001, double momentum = 0.9,
+             double weightDecay = 0.0001, bool nesterov = false)
+        : FusedOptimizer(learningRate), momentum(momentum),
+          weightDecay(weightDecay), nesterov(nesterov) {}
+
+    template <typename S>
+    void update(double *p, const double *g, S *velocity, S *, size_t n,
+                double scale) const {
+        const double gradWeight = nesterov ? 1.0 : 0.0;
+        const double velocityWeight = nesterov ? momentum : 1.0;
+        for (size_t i = 0; i < n; i += block) {
+            Index len = std::min<size_t>(block, n - i);
+            Map<ArrayXd> param(p + i, len);
+            Map<const ArrayXd> gradient(g + i, len);
+            Map<Array<S, Dynamic, 1>> stored(velocity + i, len);
+            Block grad = scale * gradient + weightDecay * param;
+            Block v = momentum * stored.template cast<double>() + grad;
+            stored = v.template cast<S>();
+            param -= learningRate * (gradWeight * grad + velocityWeight * v);
+        }
+    }
+};
+
+// Adam with bias correction. weightDecay is added to the gradient (L2)
+// unless decoupled, which is AdamW: p -= lr * weightDecay * p separately
+// from the adaptive step.
+class Adam : public FusedOptimizer<Adam> {
+  private:
+    double beta1;
+    double beta2;
+    double epsilon;
+    double weightDecay;
+    bool decoupled;
+    long steps = 0;
+    double correction1 = 1.0;
+    double correction2 = 1.0;
+
+  protected:
+    void beginStep() override {
+        steps++;
+        correction1 = 1.0 - std::pow(beta1, steps);
+        correction2 = 1.0 - std::pow(beta2, steps);
+    }
+
+  public:
+    Adam(double learningRate = 0.001, double beta1 = 0.9,
+         double beta2 = 0.999, double epsilon = 1e-8,
+         double weightDecay = 0.0, bool decoupled = false)
+        : FusedOptimizer(learningRate), beta1(beta1), beta2(beta2),
+          epsilon(epsilon), weightDecay(weightDecay), decoupled(decoupled) {}
+
+    template <typename S>
+    void update(double *p, const double *g, S *m, S *v, size_t n,
+                double scale) const {
+        const double l2 = decoupled ? 0.0 : weightDecay;
+        const double shrink = decoupled ? 1.0 - learningRate * weightDecay : 1.0;
+        const double stepSize = learningRate / correction1;
+        const double rootCorrection = std::sqrt(correction2);
+        for (size_t i = 0; i < n; i += block) {
+            Index len = std::min<size_t>(block, n - i);
+            Map<ArrayXd> param(p + i, len);
+            Map<const ArrayXd> gradient(g + i, len);
+            Map<Array<S, Dynamic, 1>> first(m + i, len);
+            Map<Array<S, Dynamic, 1>> second(v + i, len);
+            Block grad = scale * gradient + l2 * param;
+            Block mi = beta1 * first.template cast<double>() + (1.0 - beta1) * grad;
+            Block vi = beta2 * second.template cast<double>() +
+                       (1.0 - beta2) * grad.square();
+            first = mi.template cast<S>();
+            second = vi.template cast<S>();
+            param = shrink * param -
+                    stepSize * mi / (vi.sqrt() / rootCorrection + epsilon);
+        }
+    }
+};
+
+class AdamW : public Adam {
+  public:
+    AdamW(double learningRate = 0.001, double weightDecay = 0.01,
+          double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8)
+        : Adam(learningRate, beta1, beta2, epsilon, weightDecay, true) {}
+};
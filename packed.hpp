@@ -0,0 +1,120 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <vector>
+
+using namespace Eigen;
+
+// Holds weights.transpose() packed once into the GEBP panel layout used by
+// Eigen's GEMM, so frozen layers skip the lhs repack on every forward call.
+class PackedWeights {
+  private:
+    typedef internal::gebp_traits<double, double> Traits;
+    typedef internal::const_blas_data_mapper<double, Index, ColMajor>
+        LhsMapper;
+    typedef internal::const_blas_data_mapper<double, Index, ColMajor>
+        RhsMapper;
+    typedef internal::blas_data_mapper<double, Index, ColMajor> ResMapper;
+    typedef Matrix<double, Dynamic, Dynamic, RowMajor> RowMajorWeights;
+
+    std::vector<double, aligned_allocator<double>> panels;
+    std::vector<Index> panelOffsets;
+    Index rows = 0;
+    Index depth = 0;
+    Index kc = 0;
+    Index mc = 0;
+    Index nc = 0;
+
+    Index panelIndex(Index i2, Index k2) const {
+        Index depthBlocks = (depth + kc - 1) / kc;
+        return (i2 / mc) * depthBlocks + k2 / kc;
+    }
+
+  public:
+    bool empty() const { return panels.empty(); }
+
+    Index outputs() const { return rows; }
+
+    Index inputs() const { return depth; }
+
+    void clear() {
+        panels.clear();
+        panelOffsets.clear();
+        rows = depth = 0;
+    }
+
+    // weights is in x out and row-major; the packed lhs is its out x in
+    // transpose, which is a column-major view of the same storage.
+    void pack(const Ref<const RowMajorWeights> &weights,
+              Index nominalBatch = 256) {
+        depth = weights.rows();
+        rows = weights.cols();
+        kc = depth;
+        mc = rows;
+        nc = nominalBatch;
+        internal::computeProductBlockingSizes<double, double>(kc, mc, nc);
+
+        internal::gemm_pack_lhs<double, Index, LhsMapper, Traits::mr,
+                                Traits::LhsProgress,
+                                Traits::LhsPacket4Packing, ColMajor>
+            packLhs;
+        LhsMapper lhs(weights.data(), rows);
+
+        panelOffsets.clear();
+        Index total = 0;
+        for (Index i2 = 0; i2 < rows; i2 += mc) {
+            Index actualMc = std::min(i2 + mc, rows) - i2;
+            for (Index k2 = 0; k2 < depth; k2 += kc) {
+                Index actualKc = std::min(k2 + kc, depth) - k2;
+                panelOffsets.push_back(total);
+                total += actualMc * actualKc;
+            }
+        }
+        panels.assign(total, 0.0);
+
+        for (Index i2 = 0; i2 < rows; i2 += mc) {
+            Index actualMc = std::min(i2 + mc, rows) - i2;
+            for (Index k2 = 0; k2 < depth; k2 += kc) {
+                Index actualKc = std::min(k2 + kc, depth) - k2;
+                packLhs(panels.data() + panelOffsets[panelIndex(i2, k2)],
+                        lhs.getSubMapper(i2, k2), actualKc, actualMc);
+            }
+        }
+    }
+
+    // result = weights.transpose() * input, reusing the packed panels.
+    void multiply(const MatrixXd &input, MatrixXd &result) const {
+        eigen_assert(input.rows() == depth);
+        Index cols = input.cols();
+        result.setZero(rows, cols);
+
+        internal::gemm_pack_rhs<double, Index, RhsMapper, Traits::nr,
+                                ColMajor>
+            packRhs;
+        internal::gebp_kernel<double, double, Index, ResMapper, Traits::mr,
+                              Traits::nr, false, false>
+            gebp;
+        RhsMapper rhs(input.data(), depth);
+        ResMapper res(result.data(), rows);
+
+        Index actualNcMax = std::min(nc, cols);
+        std::vector<double, aligned_allocator<double>> blockB(kc *
+                                                              actualNcMax);
+
+        for (Index j2 = 0; j2 < cols; j2 += nc) {
+            Index actualNc = std::min(j2 + nc, cols) - j2;
+            for (Index k2 = 0; k2 < depth; k2 += kc) {
+                Index actualKc = std::min(k2 + kc, depth) - k2;
+                packRhs(blockB.data(), rhs.getSubMapper(k2, j2), actualKc,
+                        actualNc);
+                for (Index i2 = 0; i2 < rows; i2 += mc) {
+                    Index actualMc = std::min(i2 + mc, rows) - i2;
+                    gebp(res.getSubMapper(i2, j2),
+                         panels.data() + panelOffsets[panelIndex(i2, k2)],
+                         blockB.data(), actualMc, actualKc, actualNc, 1.0);
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,555 @@
+#pragma once
+
+#include "data.hpp"
+#include "network.hpp"
+#include "numa.hpp"
+#include "pool.hpp"
+#include <atomic>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Synchronous data-parallel training on one shared set of weights. Every
+// batch is split column-wise over the threads; thread t runs forward and
+// computeGradients on its own replica (its own activation, delta and
+// gradient buffers), the gradients are summed pairwise in a log2(threads)
+// deep tree into the network's own buffer, and the network takes one step.
+class DataParallelTrainer {
+  private:
+    Network &network;
+    WorkerPool pool;
+    // Replicas of threads 1 and up; thread 0 uses the network itself.
+    std::vector<Network> replicas;
+    std::vector<double> losses;
+
+    Network &replica(int t) {
+        return t == 0 ? network : replicas[t - 1];
+    }
+
+    // First of thread t's columns in a batch of cols.
+    Index shardBegin(int t, Index cols) const {
+        const Index shard = (cols + pool.size() - 1) / pool.size();
+        return std::min(cols, t * shard);
+    }
+
+    // At stride s, the owner o of each pair (o, o + s) receives o + s's
+    // sum; the 2s threads of the pair's subtree each add one slice. Level
+    // one also weights every shard by its share of the batch.
+    void reduceGradients(const std::vector<double> &weights) {
+        const int threads = pool.size();
+        const Index size = network.gradientVector().size();
+        for (int stride = 1; stride < threads; stride *= 2) {
+            pool.run([&](int t) {
+                int owner = t - t % (2 * stride);
+                int parts = std::min(2 * stride, threads - owner);
+                int part = t - owner;
+                Index chunk = (size + parts - 1) / parts;
+                Index begin = std::min(size, part * chunk);
+                Index length = std::min(size, begin + chunk) - begin;
+                Map<VectorXd> dst = replica(owner).gradientVector();
+                if (owner + stride >= threads) {
+                    if (stride == 1 && weights[owner] != 1.0) {
+                        dst.segment(begin, length) *= weights[owner];
+                    }
+                    return;
+                }
+                Map<VectorXd> src = replica(owner + stride).gradientVector();
+                if (stride == 1) {
+                    dst.segment(begin, length) =
+                        weights[owner] * dst.segment(begin, length) +
+                        weights[owner + 1] * src.segment(begin, length);
+                } else {
+                    dst.segment(begin, length) += src.segment(begin, length);
+                }
+            });
+        }
+    }
+
+  public:
+    DataParallelTrainer(Network &network, int threads)
+        : network(network), pool(std::max(1, threads), true) {
+        network.unfreeze();
+        for (int t = 1; t < pool.size(); t++) {
+            replicas.push_back(network.replica());
+        }
+        losses.assign(pool.size(), 0.0);
+        // Each replica allocates its gradient buffer on its own thread, so
+        // the pages are first touched on that thread's node.
+        pool.run([&](int t) {
+            if (t > 0) {
+                replicas[t - 1].detachGradients();
+            }
+        });
+    }
+
+    int threads() const {
+        return pool.size();
+    }
+
+  private:
+    // One step on a batch of cols samples; thread t's n columns starting
+    // at begin come from load(t, begin, n, input, target).
+    double runBatch(Index cols,
+                    const std::function<void(int, Index, Index, MatrixXd &,
+                                             MatrixXd &)> &load,
+                    Optimizer &optimizer) {
+        const int threads = pool.size();
+        std::vector<double> weights(threads, 0.0);
+        for (Network &net : replicas) {
+            net.syncWeightScales(network);
+        }
+
+        pool.run([&](int t) {
+            Index begin = shardBegin(t, cols);
+            Index n = shardBegin(t + 1, cols) - begin;
+            weights[t] = (double)n / cols;
+            losses[t] = 0.0;
+            if (n == 0) {
+                replica(t).gradientVector().setZero();
+                return;
+            }
+            Network &net = replica(t);
+            MatrixXd input;
+            MatrixXd target;
+            load(t, begin, n, input, target);
+            net.forward(input);
+            losses[t] = MSE(target, net.getOutput());
+            net.computeGradients(input, target);
+        });
+
+        reduceGradients(weights);
+        network.markGradientsDense();
+        network.step(optimizer);
+        // Reduction partners' buffers now hold sums, so their sparse row
+        // bookkeeping no longer covers every nonzero row.
+        for (Network &net : replicas) {
+            net.discardGradients();
+            net.markGradientsDense();
+        }
+
+        double loss = 0.0;
+        for (int t = 0; t < threads; t++) {
+            loss += weights[t] * losses[t];
+        }
+        return loss;
+    }
+
+  public:
+    // Trains on one batch and returns its loss.
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      Optimizer &optimizer) {
+        return runBatch(
+            batchInput.cols(),
+            [&](int, Index begin, Index n, MatrixXd &input,
+                MatrixXd &target) {
+                input = batchInput.middleCols(begin, n);
+                target = batchTarget.middleCols(begin, n);
+            },
+            optimizer);
+    }
+
+    // One pass in which thread t reads only dataShards[t] and
+    // labelShards[t] (one per thread, see shard_dataset), so it never
+    // touches samples on another node. Every batch of batchSize takes each
+    // thread's columns from its own shuffled shard, and the epoch ends
+    // when the first shard runs out. Returns the mean batch loss.
+    double trainEpoch(const std::vector<std::vector<VectorXd>> &dataShards,
+                      const std::vector<std::vector<VectorXd>> &labelShards,
+                      int batchSize, Optimizer &optimizer,
+                      std::mt19937 &rng) {
+        const int threads = pool.size();
+        eigen_assert((int)dataShards.size() == threads &&
+                     (int)labelShards.size() == threads);
+        std::vector<std::vector<int>> orders(threads);
+        int numBatches = INT_MAX;
+        for (int t = 0; t < threads; t++) {
+            Index begin = shardBegin(t, batchSize);
+            Index n = shardBegin(t + 1, batchSize) - begin;
+            orders[t].resize(dataShards[t].size());
+            for (size_t i = 0; i < orders[t].size(); i++) {
+                orders[t][i] = i;
+            }
+            std::shuffle(orders[t].begin(), orders[t].end(), rng);
+            if (n > 0) {
+                numBatches = std::min<int>(numBatches,
+                                           dataShards[t].size() / n);
+            }
+        }
+        double totalLoss = 0.0;
+        for (int batch = 0; batch < numBatches; batch++) {
+            totalLoss += runBatch(
+                batchSize,
+                [&](int t, Index, Index n, MatrixXd &input,
+                    MatrixXd &target) {
+                    input.resize(dataShards[t][0].size(), n);
+                    target.resize(labelShards[t][0].size(), n);
+                    for (Index i = 0; i < n; i++) {
+                        int idx = orders[t][batch * n + i];
+                        input.col(i) = dataShards[t][idx];
+                        target.col(i) = labelShards[t][idx];
+                    }
+                },
+                optimizer);
+        }
+        return numBatches > 0 ? totalLoss / numBatches : 0.0;
+    }
+
+    // One shuffled pass over data; returns the mean batch loss.
+    double trainEpoch(const std::vector<VectorXd> &data,
+                      const std::vector<VectorXd> &labels, int batchSize,
+                      Optimizer &optimizer, std::mt19937 &rng) {
+        std::vector<int> indices(data.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i] = i;
+        }
+        std::shuffle(indices.begin(), indices.end(), rng);
+        int numBatches = data.size() / batchSize;
+        double totalLoss = 0.0;
+        for (int batch = 0; batch < numBatches; batch++) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                int idx = indices[batch * batchSize + i];
+                batchInput.col(i) = data[idx];
+                batchTarget.col(i) = labels[idx];
+            }
+            totalLoss += trainBatch(batchInput, batchTarget, optimizer);
+        }
+        return numBatches > 0 ? totalLoss / numBatches : 0.0;
+    }
+
+    // Trains steps batches with 1, 2, 4, ... and maxThreads threads from the
+    // same initial parameters and prints samples/sec and the scaling
+    // efficiency against one thread. The parameters are restored after.
+    static void compareScaling(Network &network,
+                               const std::vector<VectorXd> &data,
+                               const std::vector<VectorXd> &labels,
+                               int batchSize, int maxThreads, int steps = 100,
+                               double lr = 0.003) {
+        typedef std::chrono::steady_clock Clock;
+        std::vector<double> initial = network.snapshotParameters();
+        std::vector<MatrixXd> inputs;
+        std::vector<MatrixXd> targets;
+        for (int b = 0; b < steps; b++) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                int idx = (b * batchSize + i) % data.size();
+                batchInput.col(i) = data[idx];
+                batchTarget.col(i) = labels[idx];
+            }
+            inputs.push_back(batchInput);
+            targets.push_back(batchTarget);
+        }
+
+        std::cout << "\n===== DATA-PARALLEL SCALING (batch " << batchSize
+                  << ", " << steps << " steps, "
+                  << std::thread::hardware_concurrency()
+                  << " hardware threads) =====\n";
+        std::vector<int> counts;
+        for (int threads = 1; threads < maxThreads; threads *= 2) {
+            counts.push_back(threads);
+        }
+        counts.push_back(std::max(1, maxThreads));
+
+        double baseline = 0.0;
+        for (int threads : counts) {
+            network.restoreParameters(initial);
+            SGD sgd(lr);
+            DataParallelTrainer trainer(network, threads);
+            trainer.trainBatch(inputs[0], targets[0], sgd);
+            network.restoreParameters(initial);
+
+            auto start = Clock::now();
+            for (int b = 0; b < steps; b++) {
+                trainer.trainBatch(inputs[b], targets[b], sgd);
+            }
+            double seconds =
+                std::chrono::duration<double>(Clock::now() - start).count();
+            double samplesPerSecond = steps * batchSize / seconds;
+            if (threads == 1) {
+                baseline = samplesPerSecond;
+            }
+            std::cout << std::setw(3) << threads << " threads: " << std::fixed
+                      << std::setprecision(0) << samplesPerSecond
+                      << " samples/s, speedup " << std::setprecision(2)
+                      << samplesPerSecond / baseline << "x, efficiency "
+                      << std::setprecision(1)
+                      << samplesPerSecond / baseline / threads * 100.0
+                      << "%\n";
+        }
+        std::cout << "====================================================="
+                     "=====\n\n";
+        network.restoreParameters(initial);
+    }
+};
+
+// How Hogwild workers write the shared weights: PLAIN read-modify-writes
+// race freely (updates can be lost, values can not tear on x86-64);
+// RELAXED_ATOMIC loads and stores every element with relaxed atomics, so
+// optimizer updates no longer race with each other, though concurrent
+// updates of one element can still overwrite each other. Either way the
+// forward and backward products read the weights with plain loads while
+// other threads store to them, which is still a data race.
+enum class HogwildStores {
+    PLAIN,
+    RELAXED_ATOMIC
+};
+
+// SGD with L2 weight decay written straight into weights shared by several
+// threads, without locks. Decay is applied eagerly (a shared weight scale
+// would itself be a contended value) and, under a sparse weight gradient,
+// only to the rows that have gradient.
+class HogwildSGD : public Optimizer {
+  private:
+    double weightDecay;
+    HogwildStores stores;
+
+    void update(double *p, const double *g, Index n, double scale,
+                double decay) const {
+        const double lr = learningRate;
+        if (stores == HogwildStores::PLAIN) {
+            Map<ArrayXd> param(p, n);
+            Map<const ArrayXd> gradient(g, n);
+            param -= lr * (scale * gradient + decay * param);
+            return;
+        }
+        for (Index i = 0; i < n; i++) {
+            double value;
+            __atomic_load(p + i, &value, __ATOMIC_RELAXED);
+            value -= lr * (scale * g[i] + decay * value);
+            __atomic_store(p + i, &value, __ATOMIC_RELAXED);
+        }
+    }
+
+  public:
+    HogwildSGD(double learningRate = 0.001, double weightDecay = 0.0001,
+               HogwildStores stores = HogwildStores::PLAIN)
+        : Optimizer(learningRate), weightDecay(weightDecay), stores(stores) {}
+
+    void step(std::vector<Layer> &layers, double gradientScale) override {
+        for (Layer &layer : layers) {
+            Map<VectorXd> &biases = layer.biasesView();
+            update(biases.data(), layer.biasGradientView().data(),
+                   biases.size(), gradientScale, 0.0);
+
+            Map<RowMatrixXd> &weights = layer.weightsView();
+            const Map<RowMatrixXd> &weightGradient =
+                layer.weightGradientView();
+            if (!layer.hasSparseGradient()) {
+                update(weights.data(), weightGradient.data(), weights.size(),
+                       gradientScale, weightDecay);
+                continue;
+            }
+            for (int k : layer.getGradientRows()) {
+                update(&weights(k, 0), &weightGradient(k, 0), weights.cols(),
+                       gradientScale, weightDecay);
+            }
+        }
+    }
+};
+
+// Asynchronous lock-free training: every thread pulls its own mini-batches
+// from a shared counter, computes gradients on its replica and applies them
+// to the shared weights at once with HogwildSGD, never waiting for the
+// others.
+class HogwildTrainer {
+  private:
+    Network &network;
+    WorkerPool pool;
+    // Replicas of threads 1 and up; thread 0 uses the network itself.
+    std::vector<Network> replicas;
+    HogwildSGD sgd;
+
+    Network &replica(int t) {
+        return t == 0 ? network : replicas[t - 1];
+    }
+
+  public:
+    HogwildTrainer(Network &network, int threads, double lr,
+                   HogwildStores stores = HogwildStores::PLAIN)
+        : network(network), pool(std::max(1, threads), true),
+          sgd(lr, 0.0001, stores) {
+        // Every replica must see the stored weights as the effective ones.
+        network.flushPendingDecay();
+        network.unfreeze();
+        for (int t = 1; t < pool.size(); t++) {
+            replicas.push_back(network.replica());
+        }
+        pool.run([&](int t) {
+            if (t > 0) {
+                replicas[t - 1].detachGradients();
+            }
+        });
+    }
+
+    int threads() const {
+        return pool.size();
+    }
+
+    void setLearningRate(double lr) {
+        sgd.setLearningRate(lr);
+    }
+
+    // One shuffled pass over data; returns the mean batch loss.
+    double trainEpoch(const std::vector<VectorXd> &data,
+                      const std::vector<VectorXd> &labels, int batchSize,
+                      std::mt19937 &rng) {
+        std::vector<int> indices(data.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i] = i;
+        }
+        std::shuffle(indices.begin(), indices.end(), rng);
+        const int numBatches = data.size() / batchSize;
+        std::atomic<int> nextBatch(0);
+        std::vector<double> losses(pool.size(), 0.0);
+
+        pool.run([&](int t) {
+            Network &net = replica(t);
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int batch = nextBatch.fetch_add(1); batch < numBatches;
+                 batch = nextBatch.fetch_add(1)) {
+                for (int i = 0; i < batchSize; i++) {
+                    int idx = indices[batch * batchSize + i];
+                    batchInput.col(i) = data[idx];
+                    batchTarget.col(i) = labels[idx];
+                }
+                net.forward(batchInput);
+                losses[t] += MSE(batchTarget, net.getOutput());
+                net.computeGradients(batchInput, batchTarget);
+                net.step(sgd);
+            }
+        });
+
+        double totalLoss = 0.0;
+        for (double loss : losses) {
+            totalLoss += loss;
+        }
+        return numBatches > 0 ? totalLoss / numBatches : 0.0;
+    }
+
+    // One pass in which thread t trains only on its own shuffled shard
+    // (one per thread, see shard_dataset), so it never reads samples on
+    // another node. Returns the mean batch loss.
+    double trainEpoch(const std::vector<std::vector<VectorXd>> &dataShards,
+                      const std::vector<std::vector<VectorXd>> &labelShards,
+                      int batchSize, std::mt19937 &rng) {
+        const int threads = pool.size();
+        eigen_assert((int)dataShards.size() == threads &&
+                     (int)labelShards.size() == threads);
+        std::vector<std::vector<int>> orders(threads);
+        int numBatches = 0;
+        for (int t = 0; t < threads; t++) {
+            orders[t].resize(dataShards[t].size());
+            for (size_t i = 0; i < orders[t].size(); i++) {
+                orders[t][i] = i;
+            }
+            std::shuffle(orders[t].begin(), orders[t].end(), rng);
+            numBatches += dataShards[t].size() / batchSize;
+        }
+        std::vector<double> losses(threads, 0.0);
+
+        pool.run([&](int t) {
+            const std::vector<VectorXd> &data = dataShards[t];
+            const std::vector<VectorXd> &labels = labelShards[t];
+            Network &net = replica(t);
+            MatrixXd batchInput(data.empty() ? 0 : data[0].size(), batchSize);
+            MatrixXd batchTarget(labels.empty() ? 0 : labels[0].size(),
+                                 batchSize);
+            for (size_t batch = 0; batch < data.size() / batchSize; batch++) {
+                for (int i = 0; i < batchSize; i++) {
+                    int idx = orders[t][batch * batchSize + i];
+                    batchInput.col(i) = data[idx];
+                    batchTarget.col(i) = labels[idx];
+                }
+                net.forward(batchInput);
+                losses[t] += MSE(batchTarget, net.getOutput());
+                net.computeGradients(batchInput, batchTarget);
+                net.step(sgd);
+            }
+        });
+
+        double totalLoss = 0.0;
+        for (double loss : losses) {
+            totalLoss += loss;
+        }
+        return numBatches > 0 ? totalLoss / numBatches : 0.0;
+    }
+
+    // Trains epochs passes synchronously (DataParallelTrainer with SGD) and
+    // then with Hogwild in both store modes, each from the same initial
+    // parameters and shuffles, and prints throughput and the test accuracy
+    // reached after every epoch. Every thread reads its own shard of the
+    // data, copied onto its node. The parameters are restored after.
+    static void compareWithSynchronous(
+        Network &network, const std::vector<VectorXd> &data,
+        const std::vector<VectorXd> &labels,
+        const std::vector<VectorXd> &testData,
+        const std::vector<VectorXd> &testLabels, int batchSize, int threads,
+        int epochs = 3, double lr = 0.003) {
+        typedef std::chrono::steady_clock Clock;
+        std::vector<double> initial = network.snapshotParameters();
+        const char *names[] = {"Synchronous", "Hogwild", "Hogwild atomic"};
+        std::vector<std::vector<VectorXd>> dataShards =
+            shard_dataset(data, threads);
+        std::vector<std::vector<VectorXd>> labelShards =
+            shard_dataset(labels, threads);
+
+        std::cout << "\n===== HOGWILD VS SYNCHRONOUS (" << threads
+                  << " threads, batch " << batchSize << ") =====\n";
+        for (int mode = 0; mode < 3; mode++) {
+            network.restoreParameters(initial);
+            std::mt19937 rng(42);
+            double seconds = 0.0;
+            std::vector<double> accuracies;
+            if (mode == 0) {
+                SGD sgd(lr);
+                DataParallelTrainer trainer(network, threads);
+                for (int epoch = 0; epoch < epochs; epoch++) {
+                    auto start = Clock::now();
+                    trainer.trainEpoch(dataShards, labelShards, batchSize,
+                                       sgd, rng);
+                    seconds += std::chrono::duration<double>(Clock::now() -
+                                                             start)
+                                   .count();
+                    accuracies.push_back(
+                        network.test(testData, testLabels, true));
+                }
+            } else {
+                HogwildTrainer trainer(network, threads, lr,
+                                       mode == 1
+                                           ? HogwildStores::PLAIN
+                                           : HogwildStores::RELAXED_ATOMIC);
+                for (int epoch = 0; epoch < epochs; epoch++) {
+                    auto start = Clock::now();
+                    trainer.trainEpoch(dataShards, labelShards, batchSize,
+                                       rng);
+                    seconds += std::chrono::duration<double>(Clock::now() -
+                                                             start)
+                                   .count();
+                    accuracies.push_back(
+                        network.test(testData, testLabels, true));
+                }
+            }
+
+            double samples = (double)epochs * (data.size() / batchSize) *
+                             batchSize;
+            std::cout << std::left << std::setw(15) << names[mode]
+                      << std::right << std::fixed << std::setprecision(0)
+                      << samples / seconds << " samples/s, accuracy by epoch:";
+            for (double accuracy : accuracies) {
+                std::cout << " " << std::setprecision(2) << accuracy << "%";
+            }
+            std::cout << "\n";
+        }
+        std::cout << "===================================================\n\n";
+        network.restoreParameters(initial);
+    }
+};
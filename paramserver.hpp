@@ -0,0 +1,451 @@
+#pragma once
+
+#include "comm.hpp"
+#include "data.hpp"
+#include "distributed.hpp"
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sys/mman.h>
+#include <vector>
+
+// Asynchronous training against a parameter server. The flat parameter
+// vector is split into equal ranges, each held by one server process that
+// applies pushed gradients as soon as they arrive (SGD). Worker processes
+// loop pull parameters, compute gradients on their own data shard, push.
+//
+// Consistency is stale synchronous parallel (SSP) with bound s: a worker
+// that has pushed c times may pull only once every worker has pushed at
+// least c - s times, so no worker runs more than s steps ahead of the
+// slowest. s = 0 is lock-step; a negative bound never waits (fully
+// asynchronous). Staleness of an update is the number of updates the
+// server applied between the worker's pull and its push.
+class ParameterServer {
+  public:
+    struct Stats {
+        double seconds = 0.0;
+        long updates = 0;
+        long staleUpdates = 0;
+        double stalenessSum = 0.0;
+        long maxStaleness = 0;
+        double loss = 0.0;
+    };
+
+  private:
+    enum Type : int32_t { PULL, PUSH, DONE };
+
+    struct Header {
+        int32_t type;
+        int32_t worker;
+        int64_t clock;
+        int64_t version;
+    };
+
+    struct Connection {
+        int fd;
+        std::vector<char> outbox;
+        size_t sent = 0;
+    };
+
+    struct PendingPull {
+        int worker;
+        int64_t clock;
+    };
+
+    // Results a child process leaves for the parent: per-server stats,
+    // per-worker time and loss, and the final parameters.
+    struct Shared {
+        Stats servers[64];
+        double workerSeconds[256];
+        double workerLoss[256];
+        double parameters[1];
+    };
+
+    static Shared *mapShared(size_t parameters) {
+        size_t bytes = sizeof(Shared) + parameters * sizeof(double);
+        void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            LocalSocket::fail("mmap");
+        }
+        return new (memory) Shared();
+    }
+
+    static std::vector<size_t> ranges(size_t n, int servers) {
+        std::vector<size_t> bounds(servers + 1);
+        for (int s = 0; s <= servers; s++) {
+            bounds[s] = std::min(n, AlignedBuffer::padded(n * s / servers));
+        }
+        bounds[servers] = n;
+        return bounds;
+    }
+
+    // One server's loop: polls every worker connection, applies pushes in
+    // arrival order and answers pulls once the SSP bound allows.
+    static void serve(int listenFd, double *parameters, size_t size,
+                      Transport transport, int workers, int staleness,
+                      double lr, Stats &stats) {
+        std::vector<Connection> connections;
+        for (int w = 0; w < workers; w++) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                LocalSocket::fail("accept");
+            }
+            LocalSocket::configure(fd, transport);
+            connections.push_back({fd, {}, 0});
+        }
+        // Connections arrive in any order, so clocks are kept per connection.
+        std::vector<int64_t> clocks(workers, 0);
+        std::vector<char> done(workers, 0);
+        std::vector<PendingPull> pending;
+        std::vector<double> gradient(size);
+        int64_t version = 0;
+        int finished = 0;
+
+        auto slowest = [&]() {
+            int64_t clock = std::numeric_limits<int64_t>::max();
+            for (int w = 0; w < workers; w++) {
+                if (!done[w]) {
+                    clock = std::min(clock, clocks[w]);
+                }
+            }
+            return clock;
+        };
+        auto reply = [&](int worker) {
+            Connection &c = connections[worker];
+            Header header = {PULL, worker, clocks[worker], version};
+            const char *h = reinterpret_cast<const char *>(&header);
+            const char *p = reinterpret_cast<const char *>(parameters);
+            c.outbox.insert(c.outbox.end(), h, h + sizeof(header));
+            c.outbox.insert(c.outbox.end(), p, p + size * sizeof(double));
+        };
+        auto answerPulls = [&]() {
+            int64_t floor = slowest();
+            for (size_t i = 0; i < pending.size();) {
+                if (staleness < 0 || pending[i].clock - staleness <= floor) {
+                    reply(pending[i].worker);
+                    pending.erase(pending.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+        };
+
+        while (finished < workers) {
+            std::vector<pollfd> fds;
+            for (const Connection &c : connections) {
+                short events = POLLIN;
+                if (c.sent < c.outbox.size()) {
+                    events |= POLLOUT;
+                }
+                fds.push_back({c.fd, events, 0});
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LocalSocket::fail("poll");
+            }
+            for (size_t i = 0; i < fds.size(); i++) {
+                Connection &c = connections[i];
+                if ((fds[i].revents & POLLOUT) && c.sent < c.outbox.size()) {
+                    ssize_t n = send(c.fd, c.outbox.data() + c.sent,
+                                     c.outbox.size() - c.sent, MSG_NOSIGNAL);
+                    if (n > 0) {
+                        c.sent += n;
+                    }
+                    if (c.sent == c.outbox.size()) {
+                        c.outbox.clear();
+                        c.sent = 0;
+                    }
+                }
+                if (!(fds[i].revents & (POLLIN | POLLHUP)) || done[i]) {
+                    continue;
+                }
+                Header header;
+                LocalSocket::recvAll(c.fd, &header, sizeof(header));
+                int w = i;
+                if (header.type == PULL) {
+                    pending.push_back({w, header.clock});
+                } else if (header.type == PUSH) {
+                    LocalSocket::recvAll(c.fd, gradient.data(),
+                                         size * sizeof(double));
+                    Map<VectorXd>(parameters, size) -=
+                        lr * Map<VectorXd>(gradient.data(), size);
+                    long stale = version - header.version;
+                    stats.updates++;
+                    stats.stalenessSum += stale;
+                    stats.staleUpdates += stale > 0;
+                    stats.maxStaleness = std::max(stats.maxStaleness, stale);
+                    version++;
+                    clocks[w] = header.clock;
+                } else {
+                    done[w] = 1;
+                    finished++;
+                }
+                answerPulls();
+            }
+        }
+        // Flush replies still queued.
+        for (Connection &c : connections) {
+            if (c.sent < c.outbox.size()) {
+                LocalSocket::sendAll(c.fd, c.outbox.data() + c.sent,
+                                     c.outbox.size() - c.sent);
+            }
+            close(c.fd);
+        }
+    }
+
+    // A worker's loop over its shard for epochs, against every server.
+    static void work(int worker, Network &network, Transport transport,
+                     const std::string &address,
+                     const std::vector<size_t> &bounds,
+                     const std::vector<VectorXd> &data,
+                     const std::vector<VectorXd> &labels, int batchSize,
+                     int epochs, Shared *shared) {
+        const int servers = bounds.size() - 1;
+        std::vector<int> fds;
+        for (int s = 0; s < servers; s++) {
+            fds.push_back(LocalSocket::connectTo(transport, address, s));
+            LocalSocket::configure(fds.back(), transport);
+        }
+        std::vector<int64_t> versions(servers, 0);
+        std::mt19937 rng(worker);
+        std::vector<int> indices(data.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i] = i;
+        }
+        int numBatches = data.size() / batchSize;
+        int64_t clock = 0;
+        double loss = 0.0;
+        auto start = std::chrono::steady_clock::now();
+
+        for (int epoch = 0; epoch < epochs; epoch++) {
+            std::shuffle(indices.begin(), indices.end(), rng);
+            loss = 0.0;
+            for (int batch = 0; batch < numBatches; batch++) {
+                Map<VectorXd> parameters = network.parameterVector();
+                for (int s = 0; s < servers; s++) {
+                    Header header = {PULL, worker, clock, 0};
+                    LocalSocket::sendAll(fds[s], &header, sizeof(header));
+                }
+                for (int s = 0; s < servers; s++) {
+                    Header header;
+                    LocalSocket::recvAll(fds[s], &header, sizeof(header));
+                    versions[s] = header.version;
+                    LocalSocket::recvAll(
+                        fds[s], parameters.data() + bounds[s],
+                        (bounds[s + 1] - bounds[s]) * sizeof(double));
+                }
+
+                MatrixXd batchInput(data[0].size(), batchSize);
+                MatrixXd batchTarget(labels[0].size(), batchSize);
+                for (int i = 0; i < batchSize; i++) {
+                    int idx = indices[batch * batchSize + i];
+                    batchInput.col(i) = data[idx];
+                    batchTarget.col(i) = labels[idx];
+                }
+                network.forward(batchInput);
+                loss += MSE(batchTarget, network.getOutput());
+                network.computeGradients(batchInput, batchTarget);
+                network.discardGradients();
+
+                clock++;
+                Map<VectorXd> gradients = network.gradientVector();
+                for (int s = 0; s < servers; s++) {
+                    Header header = {PUSH, worker, clock, versions[s]};
+                    LocalSocket::sendAll(fds[s], &header, sizeof(header));
+                    LocalSocket::sendAll(
+                        fds[s], gradients.data() + bounds[s],
+                        (bounds[s + 1] - bounds[s]) * sizeof(double));
+                }
+            }
+        }
+        for (int s = 0; s < servers; s++) {
+            Header header = {DONE, worker, clock, 0};
+            LocalSocket::sendAll(fds[s], &header, sizeof(header));
+            close(fds[s]);
+        }
+        shared->workerSeconds[worker] =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+                .count();
+        shared->workerLoss[worker] = numBatches > 0 ? loss / numBatches : 0.0;
+    }
+
+  public:
+    // Trains network on workers forked worker processes against servers
+    // forked server processes on this host and leaves the servers' final
+    // parameters in network. Returns the summed server stats, with seconds
+    // the slowest worker's time and loss the workers' mean last-epoch loss.
+    static Stats train(Network &network, const std::vector<VectorXd> &data,
+                       const std::vector<VectorXd> &labels, int workers,
+                       int servers, int staleness, int batchSize, int epochs,
+                       double lr, Transport transport = Transport::UNIX) {
+        workers = std::max(1, std::min(workers, 256));
+        Map<VectorXd> parameters = network.parameterVector();
+        const size_t size = parameters.size();
+        servers = std::max(1, std::min<int>(servers, 64));
+        std::vector<size_t> bounds = ranges(size, servers);
+        Shared *shared = mapShared(size);
+        std::memcpy(shared->parameters, parameters.data(),
+                    size * sizeof(double));
+        std::string address = LocalSocket::newRendezvous(transport);
+
+        std::fflush(nullptr);
+        std::vector<pid_t> children;
+        for (int s = 0; s < servers; s++) {
+            // Listen before forking so workers can connect right away.
+            int fd = LocalSocket::listenOn(transport, address, s, workers);
+            pid_t pid = fork();
+            if (pid == 0) {
+                int status = 0;
+                try {
+                    serve(fd, shared->parameters + bounds[s],
+                          bounds[s + 1] - bounds[s], transport, workers,
+                          staleness, lr, shared->servers[s]);
+                } catch (const std::exception &e) {
+                    std::fprintf(stderr, "server %d: %s\n", s, e.what());
+                    status = 1;
+                }
+                _exit(status);
+            }
+            close(fd);
+            children.push_back(pid);
+        }
+        for (int w = 0; w < workers; w++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                int status = 0;
+                try {
+                    work(w, network, transport, address, bounds,
+                         shard_for_rank(data, w, workers),
+                         shard_for_rank(labels, w, workers), batchSize,
+                         epochs, shared);
+                } catch (const std::exception &e) {
+                    std::fprintf(stderr, "worker %d: %s\n", w, e.what());
+                    status = 1;
+                }
+                std::fflush(nullptr);
+                _exit(status);
+            }
+            children.push_back(pid);
+        }
+        for (pid_t pid : children) {
+            waitpid(pid, nullptr, 0);
+        }
+        for (int s = 0; s < servers; s++) {
+            if (transport == Transport::UNIX) {
+                unlink(LocalSocket::path(address, s).c_str());
+            }
+        }
+        LocalSocket::removeRendezvous(transport, address);
+
+        Stats total;
+        for (int s = 0; s < servers; s++) {
+            const Stats &stats = shared->servers[s];
+            total.updates += stats.updates;
+            total.staleUpdates += stats.staleUpdates;
+            total.stalenessSum += stats.stalenessSum;
+            total.maxStaleness = std::max(total.maxStaleness,
+                                          stats.maxStaleness);
+        }
+        for (int w = 0; w < workers; w++) {
+            total.seconds = std::max(total.seconds, shared->workerSeconds[w]);
+            total.loss += shared->workerLoss[w] / workers;
+        }
+        network.parameterVector() =
+            Map<VectorXd>(shared->parameters, size);
+        munmap(shared, sizeof(Shared) + size * sizeof(double));
+        return total;
+    }
+
+    // Trains from network's current parameters with each staleness bound
+    // and with synchronous ring all-reduce on as many ranks, and prints
+    // throughput, staleness and test accuracy. The parameters are restored
+    // afterwards.
+    static void compareWithSynchronous(
+        Network &network, const std::vector<int> &stalenessBounds,
+        const std::vector<VectorXd> &data, const std::vector<VectorXd> &labels,
+        const std::vector<VectorXd> &testData,
+        const std::vector<VectorXd> &testLabels, int workers, int servers,
+        int batchSize, int epochs, double lr = 0.003) {
+        std::vector<double> initial = network.snapshotParameters();
+        const double samples =
+            (double)epochs * workers *
+            (data.size() / workers / batchSize * batchSize);
+        std::cout << "\n===== PARAMETER SERVER (" << workers << " workers, "
+                  << servers << " servers, batch " << batchSize << ", "
+                  << epochs << " epochs) =====\n";
+
+        for (int staleness : stalenessBounds) {
+            network.restoreParameters(initial);
+            Stats stats = train(network, data, labels, workers, servers,
+                                staleness, batchSize, epochs, lr);
+            double accuracy = network.test(testData, testLabels, true);
+            std::string label = staleness < 0
+                                    ? std::string("async")
+                                    : "SSP s = " + std::to_string(staleness);
+            std::cout << std::left << std::setw(14) << label
+                      << std::right << std::fixed << std::setprecision(0)
+                      << std::setw(8) << samples / stats.seconds
+                      << " samples/s, staleness mean " << std::setprecision(2)
+                      << (stats.updates > 0
+                              ? stats.stalenessSum / stats.updates
+                              : 0.0)
+                      << " max " << stats.maxStaleness << ", loss "
+                      << std::setprecision(6) << stats.loss << ", accuracy "
+                      << std::setprecision(2) << accuracy << "%\n";
+        }
+
+        // Synchronous baseline: the same workers as ring all-reduce ranks,
+        // one averaged update per round instead of one per worker batch.
+        // The servers apply raw gradients, so the baseline does not clip.
+        network.restoreParameters(initial);
+        Shared *shared = mapShared(initial.size());
+        RingCommunicator::launch(workers, [&](RingCommunicator &comm) {
+            network.setGradientClipping(0.0);
+            DistributedTrainer trainer(network, comm);
+            std::vector<VectorXd> shard =
+                shard_for_rank(data, comm.getRank(), workers);
+            std::vector<VectorXd> shardLabels =
+                shard_for_rank(labels, comm.getRank(), workers);
+            std::mt19937 rng(comm.getRank());
+            SGD sgd(lr, 0.0);
+            auto start = std::chrono::steady_clock::now();
+            double loss = 0.0;
+            for (int epoch = 0; epoch < epochs; epoch++) {
+                loss = trainer.trainEpoch(shard, shardLabels, batchSize, sgd,
+                                          rng);
+            }
+            if (comm.getRank() == 0) {
+                shared->workerSeconds[0] =
+                    std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+                shared->workerLoss[0] = loss;
+                Map<VectorXd> parameters = network.parameterVector();
+                std::memcpy(shared->parameters, parameters.data(),
+                            parameters.size() * sizeof(double));
+            }
+            return 0;
+        });
+        network.parameterVector() =
+            Map<VectorXd>(shared->parameters, initial.size());
+        double accuracy = network.test(testData, testLabels, true);
+        std::cout << std::left << std::setw(14) << "synchronous" << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(8)
+                  << samples / shared->workerSeconds[0]
+                  << " samples/s, staleness mean 0.00 max 0, loss "
+                  << std::setprecision(6) << shared->workerLoss[0]
+                  << ", accuracy " << std::setprecision(2) << accuracy
+                  << "%\n";
+        munmap(shared, sizeof(Shared) + initial.size() * sizeof(double));
+        std::cout << "=======================================\n\n";
+        network.restoreParameters(initial);
+    }
+};
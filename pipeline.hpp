@@ -0,0 +1,413 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Order in which a stage runs the forward (F) and backward (B) passes of
+// its micro-batches. GPIPE runs every F, then every B, so each stage holds
+// the activations of all micro-batches. ONE_F_ONE_B runs S - s - 1 warm-up
+// forwards on stage s and then alternates, holding at most S - s.
+enum class PipelineSchedule {
+    GPIPE,
+    ONE_F_ONE_B
+};
+
+// Pipeline-parallel training: the layers of a network are cut into
+// contiguous stages of about equal FLOPs, each stage runs on its own
+// pinned thread, and every batch flows through them as micro-batches.
+// Stages pass activations forward and input errors backward through
+// per-boundary mailboxes and accumulate their layers' gradients over the
+// micro-batches; the network then takes one optimizer step.
+class PipelineTrainer {
+  private:
+    // Matrices for each micro-batch of one step, handed from one stage to
+    // the next.
+    struct Mailbox {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::vector<MatrixXd> items;
+        std::vector<char> full;
+
+        void reset(int count) {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.assign(count, MatrixXd());
+            full.assign(count, 0);
+        }
+
+        void put(int m, MatrixXd item) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                items[m] = std::move(item);
+                full[m] = 1;
+            }
+            ready.notify_all();
+        }
+
+        MatrixXd take(int m) {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [&]() { return full[m] != 0; });
+            return std::move(items[m]);
+        }
+    };
+
+    struct Stage {
+        size_t first;
+        size_t last;
+        // Copies of the stage's layers for each micro-batch in flight;
+        // they share the network's parameters and gradients.
+        std::vector<std::vector<Layer>> slots;
+        std::vector<MatrixXd> inputs;
+        std::vector<MatrixXd> outputDeltas;
+        double busySeconds = 0.0;
+        double stallSeconds = 0.0;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    Network &network;
+    PipelineSchedule schedule;
+    int microBatches;
+    WorkerPool pool;
+    std::vector<Stage> stages;
+    // forwardMail[s] carries stage s's output activations to stage s + 1,
+    // backwardMail[s] stage s + 1's input errors back to stage s.
+    std::vector<std::unique_ptr<Mailbox>> forwardMail;
+    std::vector<std::unique_ptr<Mailbox>> backwardMail;
+    std::vector<double> losses;
+    // Each micro-batch's share of the batch, times the micro-batch count,
+    // so that averaging the per-micro-batch means gives the batch mean.
+    std::vector<double> weights;
+    double wallSeconds = 0.0;
+    long steps = 0;
+
+    static double seconds(Clock::time_point since) {
+        return std::chrono::duration<double>(Clock::now() - since).count();
+    }
+
+    // Cuts the layers into stageCount contiguous runs of roughly equal
+    // in * out.
+    void partition(int stageCount) {
+        size_t n = network.layerCount();
+        stageCount = std::max(1, std::min<int>(stageCount, n));
+        double total = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            total += (double)network.getLayer(i).inputs() *
+                     network.getLayer(i).outputs();
+        }
+        size_t first = 0;
+        double done = 0.0;
+        for (int s = 0; s < stageCount; s++) {
+            size_t last = first + 1;
+            done += (double)network.getLayer(first).inputs() *
+                    network.getLayer(first).outputs();
+            double target = total * (s + 1) / stageCount;
+            // Leave at least one layer for every later stage.
+            while (last < n - (stageCount - s - 1) && done < target) {
+                double next = (double)network.getLayer(last).inputs() *
+                              network.getLayer(last).outputs();
+                if (done + next / 2 > target) {
+                    break;
+                }
+                done += next;
+                last++;
+            }
+            if (s == stageCount - 1) {
+                last = n;
+            }
+            Stage stage;
+            stage.first = first;
+            stage.last = last;
+            stages.push_back(std::move(stage));
+            first = last;
+        }
+    }
+
+    int slotsFor(int s) const {
+        if (schedule == PipelineSchedule::GPIPE) {
+            return microBatches;
+        }
+        return std::min<int>(microBatches, stages.size() - s);
+    }
+
+    std::vector<std::pair<bool, int>> operations(int s, int count) const {
+        std::vector<std::pair<bool, int>> ops;
+        if (schedule == PipelineSchedule::GPIPE) {
+            for (int m = 0; m < count; m++) {
+                ops.push_back({true, m});
+            }
+            for (int m = count - 1; m >= 0; m--) {
+                ops.push_back({false, m});
+            }
+            return ops;
+        }
+        int warmup = std::min<int>(stages.size() - s - 1, count);
+        for (int m = 0; m < warmup; m++) {
+            ops.push_back({true, m});
+        }
+        for (int m = 0; m + warmup < count; m++) {
+            ops.push_back({true, m + warmup});
+            ops.push_back({false, m});
+        }
+        for (int m = std::max(0, count - warmup); m < count; m++) {
+            ops.push_back({false, m});
+        }
+        return ops;
+    }
+
+    void forwardOp(int s, int m, const std::vector<MatrixXd> &inputs,
+                   const std::vector<MatrixXd> &targets) {
+        Stage &stage = stages[s];
+        int slot = m % stage.slots.size();
+        std::vector<Layer> &layers = stage.slots[slot];
+
+        MatrixXd x;
+        if (s == 0) {
+            x = inputs[m];
+        } else {
+            auto wait = Clock::now();
+            x = forwardMail[s - 1]->take(m);
+            stage.stallSeconds += seconds(wait);
+        }
+        auto start = Clock::now();
+        stage.inputs[slot] = x;
+        for (Layer &layer : layers) {
+            layer.forward(x);
+            x = layer.getActivations();
+        }
+        if (s + 1 < (int)stages.size()) {
+            stage.busySeconds += seconds(start);
+            forwardMail[s]->put(m, std::move(x));
+            return;
+        }
+
+        Layer &output = layers.back();
+        losses[m] = MSE(targets[m], x);
+        MatrixXd error = weights[m] * (x - targets[m]);
+        if (output.getActivationType() == ActivationType::SOFTMAX) {
+            stage.outputDeltas[slot] = std::move(error);
+        } else {
+            stage.outputDeltas[slot] =
+                error.cwiseProduct(output.getActivationDerivative(x));
+        }
+        stage.busySeconds += seconds(start);
+    }
+
+    void backwardOp(int s, int m, bool accumulate) {
+        Stage &stage = stages[s];
+        int slot = m % stage.slots.size();
+        std::vector<Layer> &layers = stage.slots[slot];
+
+        MatrixXd delta;
+        if (s + 1 == (int)stages.size()) {
+            delta = stage.outputDeltas[slot];
+        } else {
+            auto wait = Clock::now();
+            MatrixXd error = backwardMail[s]->take(m);
+            stage.stallSeconds += seconds(wait);
+            delta = error.cwiseProduct(layers.back().activationDerivative());
+        }
+        auto start = Clock::now();
+        for (int j = layers.size() - 1; j >= 0; j--) {
+            layers[j].setDelta(delta);
+            const MatrixXd input =
+                j == 0 ? stage.inputs[slot] : layers[j - 1].getActivations();
+            if (j > 0) {
+                delta = layers[j].inputError().cwiseProduct(
+                    layers[j - 1].activationDerivative());
+            } else if (s > 0) {
+                backwardMail[s - 1]->put(m, layers[j].inputError());
+            }
+            layers[j].computeGradients(input, accumulate);
+        }
+        stage.busySeconds += seconds(start);
+    }
+
+    void runStage(int s, const std::vector<MatrixXd> &inputs,
+                  const std::vector<MatrixXd> &targets) {
+        bool accumulate = false;
+        for (const auto &op : operations(s, inputs.size())) {
+            if (op.first) {
+                forwardOp(s, op.second, inputs, targets);
+            } else {
+                backwardOp(s, op.second, accumulate);
+                accumulate = true;
+            }
+        }
+    }
+
+  public:
+    PipelineTrainer(Network &network, int stageCount, int microBatches,
+                    PipelineSchedule schedule = PipelineSchedule::ONE_F_ONE_B)
+        : network(network), schedule(schedule),
+          microBatches(std::max(1, microBatches)),
+          pool(std::max(1, std::min<int>(stageCount, network.layerCount())),
+               true) {
+        network.unfreeze();
+        partition(pool.size());
+        for (size_t s = 0; s < stages.size(); s++) {
+            Stage &stage = stages[s];
+            stage.slots.resize(slotsFor(s));
+            for (std::vector<Layer> &slot : stage.slots) {
+                for (size_t i = stage.first; i < stage.last; i++) {
+                    slot.push_back(network.getLayer(i));
+                    slot.back().shareParameters(network.getLayer(i));
+                    // Copies sharing one gradient buffer cannot keep
+                    // per-copy sparse row bookkeeping.
+                    slot.back().setSparseInputThreshold(0.0);
+                }
+            }
+            stage.inputs.resize(stage.slots.size());
+            stage.outputDeltas.resize(stage.slots.size());
+        }
+        for (size_t s = 0; s + 1 < stages.size(); s++) {
+            forwardMail.emplace_back(new Mailbox());
+            backwardMail.emplace_back(new Mailbox());
+        }
+    }
+
+    int stageCount() const {
+        return stages.size();
+    }
+
+    // Trains on one batch split into the configured number of micro-batches
+    // (fewer if the batch is smaller) and returns the batch's mean loss.
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      Optimizer &optimizer) {
+        Index cols = batchInput.cols();
+        std::vector<MatrixXd> inputs;
+        std::vector<MatrixXd> targets;
+        std::vector<Index> sizes;
+        for (int m = 0; m < microBatches; m++) {
+            Index c = cols * m / microBatches;
+            Index n = cols * (m + 1) / microBatches - c;
+            if (n > 0) {
+                inputs.push_back(batchInput.middleCols(c, n));
+                targets.push_back(batchTarget.middleCols(c, n));
+                sizes.push_back(n);
+            }
+        }
+        int count = inputs.size();
+        weights.resize(count);
+        for (int m = 0; m < count; m++) {
+            weights[m] = (double)count * sizes[m] / cols;
+        }
+        for (auto &mail : forwardMail) {
+            mail->reset(count);
+        }
+        for (auto &mail : backwardMail) {
+            mail->reset(count);
+        }
+        losses.assign(count, 0.0);
+        for (Stage &stage : stages) {
+            for (std::vector<Layer> &slot : stage.slots) {
+                for (size_t i = 0; i < slot.size(); i++) {
+                    slot[i].setWeightScale(
+                        network.getLayer(stage.first + i).getWeightScale());
+                }
+            }
+        }
+
+        auto start = Clock::now();
+        pool.run([&](int s) { runStage(s, inputs, targets); });
+        wallSeconds += seconds(start);
+        steps++;
+
+        network.markGradientsDense();
+        network.markGradientsAccumulated(count);
+        network.step(optimizer);
+
+        double loss = 0.0;
+        for (int m = 0; m < count; m++) {
+            loss += losses[m] * sizes[m];
+        }
+        return loss / cols;
+    }
+
+    // Per stage: layers, time computing, time stalled waiting for a
+    // neighbour, and the idle share of the pipeline's wall time (bubble).
+    void printReport() const {
+        std::cout << "\n===== PIPELINE ("
+                  << (schedule == PipelineSchedule::GPIPE ? "GPipe" : "1F1B")
+                  << ", " << stages.size() << " stages, " << microBatches
+                  << " micro-batches, " << steps << " steps) =====\n";
+        for (size_t s = 0; s < stages.size(); s++) {
+            const Stage &stage = stages[s];
+            double bubble =
+                wallSeconds > 0.0
+                    ? (1.0 - stage.busySeconds / wallSeconds) * 100.0
+                    : 0.0;
+            std::cout << "Stage " << s << " (layers " << stage.first << "-"
+                      << stage.last - 1 << ", " << stage.slots.size()
+                      << " in flight): busy " << std::fixed
+                      << std::setprecision(1) << stage.busySeconds * 1000.0
+                      << " ms, stalled " << stage.stallSeconds * 1000.0
+                      << " ms, bubble " << bubble << "%\n";
+        }
+        double ideal = (double)(stages.size() - 1) /
+                       (microBatches + stages.size() - 1) * 100.0;
+        std::cout << "Wall time: " << std::fixed << std::setprecision(1)
+                  << wallSeconds * 1000.0 << " ms (ideal bubble " << ideal
+                  << "%)\n";
+        std::cout << "=================================================\n\n";
+    }
+
+    void resetReport() {
+        for (Stage &stage : stages) {
+            stage.busySeconds = 0.0;
+            stage.stallSeconds = 0.0;
+        }
+        wallSeconds = 0.0;
+        steps = 0;
+    }
+
+    // Trains the same batches from the same parameters with both schedules
+    // and prints each one's per-stage report. The parameters are restored
+    // afterwards.
+    static void compareSchedules(Network &network,
+                                 const std::vector<VectorXd> &data,
+                                 const std::vector<VectorXd> &labels,
+                                 int batchSize, int stageCount,
+                                 int microBatches, int steps = 50,
+                                 double lr = 0.003) {
+        std::vector<double> initial = network.snapshotParameters();
+        std::vector<MatrixXd> inputs;
+        std::vector<MatrixXd> targets;
+        for (int b = 0; b < steps; b++) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                int idx = (b * batchSize + i) % data.size();
+                batchInput.col(i) = data[idx];
+                batchTarget.col(i) = labels[idx];
+            }
+            inputs.push_back(batchInput);
+            targets.push_back(batchTarget);
+        }
+
+        for (PipelineSchedule schedule :
+             {PipelineSchedule::GPIPE, PipelineSchedule::ONE_F_ONE_B}) {
+            network.restoreParameters(initial);
+            SGD sgd(lr);
+            PipelineTrainer trainer(network, stageCount, microBatches,
+                                    schedule);
+            trainer.trainBatch(inputs[0], targets[0], sgd);
+            network.restoreParameters(initial);
+            trainer.resetReport();
+
+            double loss = 0.0;
+            for (int b = 0; b < steps; b++) {
+                loss = trainer.trainBatch(inputs[b], targets[b], sgd);
+            }
+            trainer.printReport();
+            std::cout << "Final batch loss: " << std::setprecision(6) << loss
+                      << "\n";
+        }
+        network.restoreParameters(initial);
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "buffers.hpp"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Assigns offsets in one workspace to buffers whose lifetimes over a
+// schedule of steps are known up front. Buffers live at the same step get
+// disjoint ranges; all others may share memory. Buffers are placed largest
+// first into the lowest gap that fits.
+class MemoryPlanner {
+  private:
+    struct Buffer {
+        size_t size;
+        int first;
+        int last;
+        size_t offset;
+    };
+
+    std::vector<Buffer> buffers;
+    size_t workspaceSize = 0;
+
+    static bool overlaps(const Buffer &a, const Buffer &b) {
+        return a.first <= b.last && b.first <= a.last;
+    }
+
+  public:
+    void clear() {
+        buffers.clear();
+        workspaceSize = 0;
+    }
+
+    // A buffer of size doubles that is live from step first through step
+    // last. Returns its id for offset().
+    int add(size_t size, int first, int last) {
+        buffers.push_back({AlignedBuffer::padded(size), first, last, 0});
+        return buffers.size() - 1;
+    }
+
+    void plan() {
+        std::vector<int> order(buffers.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return buffers[a].size > buffers[b].size;
+        });
+
+        workspaceSize = 0;
+        std::vector<int> placed;
+        for (int id : order) {
+            Buffer &buffer = buffers[id];
+            std::vector<const Buffer *> live;
+            for (int other : placed) {
+                if (overlaps(buffer, buffers[other])) {
+                    live.push_back(&buffers[other]);
+                }
+            }
+            std::sort(live.begin(), live.end(),
+                      [](const Buffer *a, const Buffer *b) {
+                          return a->offset < b->offset;
+                      });
+            size_t offset = 0;
+            for (const Buffer *other : live) {
+                if (offset + buffer.size <= other->offset) {
+                    break;
+                }
+                offset = std::max(offset, other->offset + other->size);
+            }
+            buffer.offset = offset;
+            workspaceSize = std::max(workspaceSize, offset + buffer.size);
+            placed.push_back(id);
+        }
+    }
+
+    size_t offset(int id) const {
+        return buffers[id].offset;
+    }
+
+    // Doubles the planned workspace needs.
+    size_t size() const {
+        return workspaceSize;
+    }
+
+    // Doubles needed when every buffer keeps memory of its own.
+    size_t naiveSize() const {
+        size_t total = 0;
+        for (const Buffer &buffer : buffers) {
+            total += buffer.size;
+        }
+        return total;
+    }
+
+    // Largest total size live at any one step; no plan can go below it.
+    size_t peakLiveSize() const {
+        int steps = 0;
+        for (const Buffer &buffer : buffers) {
+            steps = std::max(steps, buffer.last + 1);
+        }
+        size_t peak = 0;
+        for (int step = 0; step < steps; step++) {
+            size_t live = 0;
+            for (const Buffer &buffer : buffers) {
+                if (buffer.first <= step && step <= buffer.last) {
+                    live += buffer.size;
+                }
+            }
+            peak = std::max(peak, live);
+        }
+        return peak;
+    }
+};
+
+// Storage for one plan. A copy starts empty, so a copied network plans its
+// own workspace instead of sharing per-batch buffers with the original.
+struct Workspace {
+    std::unique_ptr<AlignedBuffer> buffer;
+    Eigen::Index batchSize = 0;
+    bool active = false;
+
+    Workspace() = default;
+
+    Workspace(const Workspace &) {}
+
+    Workspace &operator=(const Workspace &) {
+        buffer.reset();
+        batchSize = 0;
+        active = false;
+        return *this;
+    }
+
+    Workspace(Workspace &&) noexcept = default;
+    Workspace &operator=(Workspace &&) noexcept = default;
+};
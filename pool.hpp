@@ -0,0 +1,102 @@
+#pragma once
+
+#include "numa.hpp"
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool of size threads. run(fn) calls fn(t) for every t, with
+// t = 0 on the calling thread, and returns once all calls finished. A pinned
+// pool pins worker t to entry t of the creating thread's Numa::allowedCpus()
+// (entry 0 is left to the caller) and makes that CPU's node its preferred
+// memory; other pools leave their workers to the scheduler, so pools that
+// run at the same time, e.g. an optimizer's inside a trainer's, never share
+// a pinned core.
+class WorkerPool {
+  private:
+    // CPUs to pin workers to; empty unless pinned.
+    std::vector<int> cpus;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::function<void(int)> job;
+    long generation = 0;
+    int pending = 0;
+    bool stopping = false;
+
+    void workerLoop(int t) {
+        if (!cpus.empty()) {
+            int cpu = cpus[t % cpus.size()];
+            if (Numa::pinThreadToCpu(cpu)) {
+                Numa::preferNode(Numa::nodeOfCpu(cpu));
+            } else {
+                std::cerr << "WorkerPool: cannot pin worker " << t
+                          << " to CPU " << cpu << ": "
+                          << std::strerror(errno) << "\n";
+            }
+        }
+
+        long seen = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            job(t);
+            lock.lock();
+            if (--pending == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+  public:
+    explicit WorkerPool(int threads, bool pin = false) {
+        if (pin) {
+            cpus = Numa::allowedCpus();
+        }
+        for (int t = 1; t < threads; t++) {
+            workers.emplace_back(&WorkerPool::workerLoop, this, t);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    int size() const {
+        return workers.size() + 1;
+    }
+
+    void run(const std::function<void(int)> &fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = fn;
+            pending = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        fn(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() { return pending == 0; });
+    }
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include "comm.hpp"
+#include "data.hpp"
+#include "network.hpp"
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+// What each data-parallel rank keeps only a shard of (ZeRO stages 0-1).
+// Parameters and gradients stay replicated: every layer's gradients are a
+// view into the network's one flat buffer, which backward writes in full.
+enum class ShardingStage {
+    // Plain all-reduce, full optimizer state on every rank.
+    NONE,
+    OPTIMIZER_STATE
+};
+
+// Synchronous data-parallel training with the optimizer state partitioned
+// across ranks. The parameters (in the optimizer's weights-then-biases
+// order) are split into one contiguous range per rank. After backward the
+// gradients are reduce-scattered so every rank holds the summed gradient
+// of its own range, the rank's optimizer updates just that range with
+// state for just that range, and an all-gather of the parameters brings
+// every rank back to the same bits. This sends as much as one all-reduce.
+class ShardedTrainer {
+  private:
+    Network &network;
+    RingCommunicator &communicator;
+    ShardingStage stage;
+    int microBatches = 1;
+    // This rank's range in optimizer order, and every rank's range in the
+    // flat parameter and gradient buffers.
+    size_t shardBegin = 0;
+    size_t shardEnd = 0;
+    std::vector<size_t> flatBounds;
+
+    // Flat buffer index of element i in weights-then-biases order; the
+    // total count maps to the end of the buffer.
+    size_t flatIndex(size_t i) const {
+        size_t offset = 0;
+        for (size_t l = 0; l < network.layerCount(); l++) {
+            size_t weights =
+                network.getLayer(l).inputs() * network.getLayer(l).outputs();
+            size_t biases = network.getLayer(l).outputs();
+            if (i < weights) {
+                return offset + i;
+            }
+            if (i < weights + biases) {
+                return offset + AlignedBuffer::padded(weights) + i - weights;
+            }
+            i -= weights + biases;
+            offset += Layer::parameterCount(network.getLayer(l).inputs(),
+                                            network.getLayer(l).outputs());
+        }
+        return offset;
+    }
+
+    void planShards() {
+        size_t total = 0;
+        for (size_t l = 0; l < network.layerCount(); l++) {
+            const Layer &layer = network.getLayer(l);
+            total += layer.inputs() * layer.outputs() + layer.outputs();
+        }
+        const int ranks = communicator.size();
+        std::vector<size_t> bounds(ranks + 1);
+        flatBounds.resize(ranks + 1);
+        for (int r = 0; r <= ranks; r++) {
+            // Multiples of 8 keep every shard's blocks vector-aligned.
+            bounds[r] = r == ranks ? total : total * r / ranks / 8 * 8;
+            flatBounds[r] = flatIndex(bounds[r]);
+        }
+        if (stage == ShardingStage::NONE) {
+            shardBegin = 0;
+            shardEnd = SIZE_MAX;
+        } else {
+            shardBegin = bounds[communicator.getRank()];
+            shardEnd = bounds[communicator.getRank() + 1];
+        }
+    }
+
+    size_t ownBegin() const {
+        return flatBounds[communicator.getRank()];
+    }
+
+    size_t ownSize() const {
+        return flatBounds[communicator.getRank() + 1] - ownBegin();
+    }
+
+    // Zeroes the gradients of other ranks' ranges, which hold partial sums
+    // after the reduce-scatter, so the local norm covers this shard only.
+    void dropForeignGradients() {
+        Map<VectorXd> gradients = network.gradientVector();
+        gradients.head(ownBegin()).setZero();
+        gradients.tail(gradients.size() - ownBegin() - ownSize()).setZero();
+    }
+
+  public:
+    static const char *stageName(ShardingStage stage) {
+        switch (stage) {
+        case ShardingStage::OPTIMIZER_STATE:
+            return "Optimizer state";
+        case ShardingStage::NONE:
+        default:
+            return "Replicated";
+        }
+    }
+
+    // Starts every rank from rank 0's parameters.
+    ShardedTrainer(Network &network, RingCommunicator &communicator,
+                   ShardingStage stage = ShardingStage::OPTIMIZER_STATE)
+        : network(network), communicator(communicator), stage(stage) {
+        planShards();
+        std::vector<double> parameters = network.snapshotParameters();
+        communicator.broadcast(parameters.data(), parameters.size());
+        network.restoreParameters(parameters);
+    }
+
+    // Splits each rank's batch into micro-batches whose gradients are
+    // accumulated before the step.
+    void setMicroBatches(int count) {
+        microBatches = std::max(1, count);
+    }
+
+    // Restricts the optimizer to this rank's shard; call once before
+    // training with it. Drops the optimizer's state.
+    template <typename Derived>
+    void shard(FusedOptimizer<Derived> &optimizer) const {
+        optimizer.setShard(shardBegin, shardEnd);
+    }
+
+    size_t gradientBytes() const {
+        return network.gradientVector().size() * sizeof(double);
+    }
+
+    size_t parameterBytes() const {
+        return network.parameterCount() * sizeof(double);
+    }
+
+    // Forward and gradients on this rank's batch, then one step with the
+    // mean over ranks by the sharded optimizer. Returns the local loss.
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      Optimizer &optimizer) {
+        const int ranks = communicator.size();
+        const Index cols = batchInput.cols();
+        double loss = 0.0;
+        for (int m = 0; m < microBatches; m++) {
+            Index begin = cols * m / microBatches;
+            Index n = cols * (m + 1) / microBatches - begin;
+            MatrixXd input = batchInput.middleCols(begin, n);
+            MatrixXd target = batchTarget.middleCols(begin, n);
+            network.forward(input);
+            loss += MSE(target, network.getOutput()) * n;
+            // Weighted so that uneven micro-batches average to the batch
+            // mean once step() divides by the micro-batch count.
+            network.computeGradients(input, target,
+                                     (double)microBatches * n / cols);
+        }
+
+        Map<VectorXd> gradients = network.gradientVector();
+        if (stage == ShardingStage::NONE) {
+            communicator.allReduce(gradients.data(), gradients.size());
+        } else {
+            communicator.reduceScatter(gradients.data(), flatBounds);
+            dropForeignGradients();
+            network.setGradientNormReduction(
+                [this](double s) { return communicator.allReduce(s); });
+        }
+        // The sum covers other ranks' rows too, and step() divides by
+        // all ranks' micro-batches.
+        network.markGradientsDense();
+        network.markGradientsAccumulated(microBatches * (ranks - 1));
+        network.step(optimizer);
+        network.setGradientNormReduction(nullptr);
+        if (stage != ShardingStage::NONE) {
+            communicator.allGather(network.parameterVector().data(),
+                                   flatBounds);
+        }
+        return loss / cols;
+    }
+
+    // One pass over this rank's shard of the data; returns the mean loss
+    // over all ranks. Shards must be the same size.
+    double trainEpoch(const std::vector<VectorXd> &data,
+                      const std::vector<VectorXd> &labels, int batchSize,
+                      Optimizer &optimizer, std::mt19937 &rng) {
+        std::vector<int> indices(data.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i] = i;
+        }
+        std::shuffle(indices.begin(), indices.end(), rng);
+        int numBatches = data.size() / batchSize;
+        double totalLoss = 0.0;
+        for (int batch = 0; batch < numBatches; batch++) {
+            MatrixXd batchInput(data[0].size(), batchSize);
+            MatrixXd batchTarget(labels[0].size(), batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                int idx = indices[batch * batchSize + i];
+                batchInput.col(i) = data[idx];
+                batchTarget.col(i) = labels[idx];
+            }
+            totalLoss += trainBatch(batchInput, batchTarget, optimizer);
+        }
+        double loss = numBatches > 0 ? totalLoss / numBatches : 0.0;
+        return communicator.allReduce(loss) / communicator.size();
+    }
+
+    // Trains epochs with Adam on ranks forked processes from network's
+    // current parameters once per stage, and prints each rank's memory for
+    // parameters, gradients and optimizer state, the change against full
+    // replication, step time, loss, rank 0's test accuracy and
+    // how far the parameters end from the unsharded run.
+    static void compareStages(Network &network,
+                              const std::vector<VectorXd> &data,
+                              const std::vector<VectorXd> &labels,
+                              const std::vector<VectorXd> &testData,
+                              const std::vector<VectorXd> &testLabels,
+                              int ranks, int batchSize, int microBatches,
+                              int epochs, double lr = 0.001) {
+        typedef std::chrono::steady_clock Clock;
+        const size_t size = network.parameterCount();
+        // Rank 0 of the unsharded run leaves its total memory and final
+        // parameters here for the later runs.
+        const size_t bytes = (2 * size + 1) * sizeof(double);
+        void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            LocalSocket::fail("mmap");
+        }
+        double *replicated = static_cast<double *>(memory);
+        double *reference = replicated + 1;
+        double *result = reference + size;
+        auto mib = [](size_t b) { return b / (1024.0 * 1024.0); };
+        std::cout << "\n===== SHARDED OPTIMIZER STATE (" << ranks
+                  << " ranks, Adam, batch " << batchSize << " per rank in "
+                  << microBatches << " micro-batches, " << epochs
+                  << " epochs) =====\n";
+        std::cout << "Per rank MiB: parameters + gradients + optimizer "
+                     "state\n";
+        for (ShardingStage stage :
+             {ShardingStage::NONE, ShardingStage::OPTIMIZER_STATE}) {
+            std::fflush(nullptr);
+            RingCommunicator::launch(ranks, [&](RingCommunicator &comm) {
+                ShardedTrainer trainer(network, comm, stage);
+                trainer.setMicroBatches(microBatches);
+                Adam adam(lr);
+                trainer.shard(adam);
+                std::vector<VectorXd> shard =
+                    shard_for_rank(data, comm.getRank(), ranks);
+                std::vector<VectorXd> shardLabels =
+                    shard_for_rank(labels, comm.getRank(), ranks);
+                std::mt19937 rng(comm.getRank());
+                auto start = Clock::now();
+                double loss = 0.0;
+                for (int epoch = 0; epoch < epochs; epoch++) {
+                    loss = trainer.trainEpoch(shard, shardLabels, batchSize,
+                                              adam, rng);
+                }
+                double seconds =
+                    std::chrono::duration<double>(Clock::now() - start)
+                        .count();
+                long steps = epochs * (long)(shard.size() / batchSize);
+                if (comm.getRank() != 0) {
+                    return 0;
+                }
+                double state = adam.stateMemoryBytes();
+                Map<VectorXd> parameters = network.parameterVector();
+                double *out =
+                    stage == ShardingStage::NONE ? reference : result;
+                std::memcpy(out, parameters.data(), size * sizeof(double));
+                double total = trainer.parameterBytes() +
+                               trainer.gradientBytes() + state;
+                if (stage == ShardingStage::NONE) {
+                    *replicated = total;
+                }
+                double deviation =
+                    (Map<VectorXd>(result, size) -
+                     Map<VectorXd>(reference, size))
+                        .cwiseAbs()
+                        .maxCoeff();
+                std::cout << std::left << std::setw(16) << stageName(stage)
+                          << std::right << std::fixed << std::setprecision(2)
+                          << mib(trainer.parameterBytes()) << " + "
+                          << mib(trainer.gradientBytes()) << " + "
+                          << mib(state) << " = " << mib(total) << " MiB";
+                if (stage != ShardingStage::NONE) {
+                    double change = (total / *replicated - 1.0) * 100.0;
+                    std::cout << (change <= 0.0 ? " (saves " : " (costs ")
+                              << std::setprecision(1) << std::abs(change)
+                              << "%, max |dp| " << std::scientific
+                              << std::setprecision(1) << deviation << ")";
+                }
+                std::cout << std::fixed << ", " << std::setprecision(2)
+                          << seconds / steps * 1000.0 << " ms/step, loss "
+                          << std::setprecision(6) << loss << ", accuracy "
+                          << std::setprecision(2)
+                          << network.test(testData, testLabels, true)
+                          << "%\n";
+                return 0;
+            });
+        }
+        munmap(memory, bytes);
+        std::cout << "=======================================\n\n";
+    }
+};
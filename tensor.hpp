@@ -0,0 +1,385 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+// How a layer's in x out weight matrix is cut across threads. COLUMNS gives
+// each thread a range of output units: it needs the whole input and yields
+// its units' activations. ROWS gives each thread a range of input units:
+// it needs only those inputs and yields a partial sum of every output.
+enum class ShardAxis {
+    COLUMNS,
+    ROWS
+};
+
+// Tensor-parallel copy of a network for layers too wide for one core. Every
+// layer's weights are sharded across a worker pool; thread t allocates,
+// reads and updates only its own shards, so they stay in its cache and on
+// its NUMA node. Layers alternate COLUMNS and ROWS (ending with ROWS), so a
+// COLUMNS layer's output shard is exactly the next layer's input shard. The
+// only exchange is summing the partial outputs of each ROWS layer and the
+// partial input errors of each COLUMNS layer in backward, each thread
+// reducing one range of batch columns.
+class TensorParallelNetwork {
+  private:
+    struct Shard {
+        RowMatrixXd weights;
+        VectorXd biases;
+        RowMatrixXd weightGradient;
+        VectorXd biasGradient;
+        // COLUMNS: the thread's output units.
+        MatrixXd activations;
+        MatrixXd delta;
+        // ROWS: partial pre-activations; COLUMNS: partial input error.
+        MatrixXd partial;
+    };
+
+    struct ShardedLayer {
+        ShardAxis axis;
+        ActivationType type;
+        double alpha;
+        Index in;
+        Index out;
+        // Thread t owns units [bounds[t], bounds[t + 1]) of the sharded axis.
+        std::vector<Index> bounds;
+        std::vector<Shard> shards;
+        // ROWS: the reduced activations and delta, the same for all threads.
+        MatrixXd output;
+        MatrixXd delta;
+    };
+
+    WorkerPool pool;
+    std::vector<ShardedLayer> layers;
+    std::vector<double> losses;
+
+    static std::vector<Index> split(Index n, int parts) {
+        std::vector<Index> bounds(parts + 1);
+        for (int t = 0; t <= parts; t++) {
+            bounds[t] = n * t / parts;
+        }
+        return bounds;
+    }
+
+    static MatrixXd activate(const ShardedLayer &layer, const MatrixXd &y) {
+        switch (layer.type) {
+        case ActivationType::SIGMOID:
+            return sigmoid(y);
+        case ActivationType::LEAKY_RELU:
+            return leakyRelu(y, layer.alpha);
+        case ActivationType::SOFTMAX:
+            return softmax(y);
+        case ActivationType::RELU:
+        default:
+            return relu(y);
+        }
+    }
+
+    // Same as Layer::getActivationDerivative.
+    static MatrixXd derivative(const ShardedLayer &layer, const MatrixXd &a) {
+        switch (layer.type) {
+        case ActivationType::SIGMOID:
+            return dSigmoid(a);
+        case ActivationType::LEAKY_RELU:
+            return dLeakyRelu(a, layer.alpha);
+        case ActivationType::SOFTMAX:
+            return dSoftmax(a);
+        case ActivationType::RELU:
+        default:
+            return dRelu(a);
+        }
+    }
+
+    // Thread t's view of layer l's input: the batch or a ROWS layer's
+    // output (whole), or a COLUMNS layer's output shard.
+    const MatrixXd &layerInput(size_t l, int t, const MatrixXd &batch) const {
+        if (l == 0) {
+            return batch;
+        }
+        const ShardedLayer &previous = layers[l - 1];
+        return previous.axis == ShardAxis::ROWS ? previous.output
+                                                : previous.shards[t].activations;
+    }
+
+    // Rows of layer l's input that thread t multiplies with its shard.
+    Block<const MatrixXd> shardInput(size_t l, int t,
+                                     const MatrixXd &batch) const {
+        const MatrixXd &x = layerInput(l, t, batch);
+        const ShardedLayer &layer = layers[l];
+        if (layer.axis == ShardAxis::COLUMNS ||
+            (l > 0 && layers[l - 1].axis == ShardAxis::COLUMNS)) {
+            return x.middleRows(0, x.rows());
+        }
+        return x.middleRows(layer.bounds[t],
+                            layer.bounds[t + 1] - layer.bounds[t]);
+    }
+
+    void forwardShard(size_t l, int t, const MatrixXd &batch) {
+        ShardedLayer &layer = layers[l];
+        Shard &shard = layer.shards[t];
+        Block<const MatrixXd> x = shardInput(l, t, batch);
+        if (layer.axis == ShardAxis::COLUMNS) {
+            MatrixXd y = shard.weights.transpose() * x;
+            y.colwise() += shard.biases;
+            shard.activations = activate(layer, y);
+        } else {
+            shard.partial.noalias() = shard.weights.transpose() * x;
+        }
+    }
+
+    // Columns [begin, end) of a ROWS layer's output; for the output layer
+    // also its delta and loss.
+    void reduceOutput(size_t l, int t, Index begin, Index end,
+                      const MatrixXd *target) {
+        ShardedLayer &layer = layers[l];
+        Index n = end - begin;
+        MatrixXd y = MatrixXd::Zero(layer.out, n);
+        for (const Shard &shard : layer.shards) {
+            y += shard.partial.middleCols(begin, n);
+        }
+        y.colwise() += layer.shards[0].biases;
+        layer.output.middleCols(begin, n) = activate(layer, y);
+        if (target == nullptr || n == 0) {
+            return;
+        }
+        MatrixXd output = layer.output.middleCols(begin, n);
+        MatrixXd error = output - target->middleCols(begin, n);
+        losses[t] = error.array().square().sum();
+        if (layer.type == ActivationType::SOFTMAX) {
+            layer.delta.middleCols(begin, n) = error;
+        } else {
+            layer.delta.middleCols(begin, n) =
+                error.cwiseProduct(derivative(layer, output));
+        }
+    }
+
+    // Gradients and SGD update of thread t's shard of layer l, after
+    // passing its error on to layer l - 1.
+    void backwardShard(size_t l, int t, const MatrixXd &batch, double lr) {
+        ShardedLayer &layer = layers[l];
+        Shard &shard = layer.shards[t];
+        Block<const MatrixXd> x = shardInput(l, t, batch);
+        const MatrixXd &delta =
+            layer.axis == ShardAxis::ROWS ? layer.delta : shard.delta;
+        double scale = 1.0 / batch.cols();
+
+        if (l > 0) {
+            ShardedLayer &previous = layers[l - 1];
+            if (layer.axis == ShardAxis::COLUMNS) {
+                shard.partial.noalias() = shard.weights * delta;
+            } else if (previous.axis == ShardAxis::COLUMNS) {
+                Shard &below = previous.shards[t];
+                below.delta = (shard.weights * delta)
+                                  .cwiseProduct(derivative(previous,
+                                                           below.activations));
+            } else {
+                // ROWS after ROWS: every thread fills its rows of the
+                // shared delta.
+                Index begin = layer.bounds[t];
+                Index n = layer.bounds[t + 1] - begin;
+                previous.delta.middleRows(begin, n) =
+                    (shard.weights * delta)
+                        .cwiseProduct(derivative(
+                            previous, previous.output.middleRows(begin, n)));
+            }
+        }
+
+        shard.weightGradient.noalias() = x * delta.transpose() * scale;
+        shard.weights -= lr * shard.weightGradient;
+        if (layer.axis == ShardAxis::COLUMNS || t == 0) {
+            shard.biasGradient = delta.rowwise().sum() * scale;
+            shard.biases -= lr * shard.biasGradient;
+        }
+    }
+
+    // Columns [begin, end) of the input error of COLUMNS layer l, turned
+    // into the delta of the ROWS layer below.
+    void reduceError(size_t l, Index begin, Index end) {
+        ShardedLayer &layer = layers[l];
+        ShardedLayer &previous = layers[l - 1];
+        Index n = end - begin;
+        MatrixXd error = MatrixXd::Zero(layer.in, n);
+        for (const Shard &shard : layer.shards) {
+            error += shard.partial.middleCols(begin, n);
+        }
+        previous.delta.middleCols(begin, n) = error.cwiseProduct(
+            derivative(previous, previous.output.middleCols(begin, n)));
+    }
+
+    void forward(const MatrixXd &batch, const MatrixXd *target) {
+        const int threads = pool.size();
+        std::vector<Index> columns = split(batch.cols(), threads);
+        for (size_t l = 0; l < layers.size(); l++) {
+            ShardedLayer &layer = layers[l];
+            pool.run([&](int t) { forwardShard(l, t, batch); });
+            if (layer.axis == ShardAxis::ROWS) {
+                layer.output.resize(layer.out, batch.cols());
+                layer.delta.resize(layer.out, batch.cols());
+                bool last = l + 1 == layers.size();
+                pool.run([&](int t) {
+                    reduceOutput(l, t, columns[t], columns[t + 1],
+                                 last ? target : nullptr);
+                });
+            }
+        }
+    }
+
+  public:
+    // Shards a copy of network's current parameters over threads.
+    TensorParallelNetwork(const Network &network, int threads)
+        : pool(std::max(1, threads), true) {
+        const int count = pool.size();
+        size_t n = network.layerCount();
+        layers.resize(n);
+        for (int l = n - 1; l >= 0; l--) {
+            const Layer &source = network.getLayer(l);
+            ShardedLayer &layer = layers[l];
+            bool nextIsRows =
+                l + 1 < (int)n && layers[l + 1].axis == ShardAxis::ROWS;
+            layer.axis = nextIsRows &&
+                                 source.getActivationType() !=
+                                     ActivationType::SOFTMAX
+                             ? ShardAxis::COLUMNS
+                             : ShardAxis::ROWS;
+            layer.type = source.getActivationType();
+            layer.alpha = source.getLeakyReluAlpha();
+            layer.in = source.inputs();
+            layer.out = source.outputs();
+            layer.bounds = split(layer.axis == ShardAxis::COLUMNS ? layer.out
+                                                                  : layer.in,
+                                 count);
+            layer.shards.resize(count);
+        }
+
+        // Each thread copies its own shards, so their pages are first
+        // touched on its node.
+        pool.run([&](int t) {
+            for (size_t l = 0; l < n; l++) {
+                ShardedLayer &layer = layers[l];
+                Shard &shard = layer.shards[t];
+                const Layer &source = network.getLayer(l);
+                MatrixXd weights = source.getWeights();
+                VectorXd biases = source.getBiases();
+                Index begin = layer.bounds[t];
+                Index size = layer.bounds[t + 1] - begin;
+                if (layer.axis == ShardAxis::COLUMNS) {
+                    shard.weights = weights.middleCols(begin, size);
+                    shard.biases = biases.segment(begin, size);
+                } else {
+                    shard.weights = weights.middleRows(begin, size);
+                    if (t == 0) {
+                        shard.biases = biases;
+                    }
+                }
+                shard.weightGradient.setZero(shard.weights.rows(),
+                                             shard.weights.cols());
+                shard.biasGradient.setZero(shard.biases.size());
+            }
+        });
+    }
+
+    int threads() const {
+        return pool.size();
+    }
+
+    ShardAxis axis(size_t l) const {
+        return layers[l].axis;
+    }
+
+    MatrixXd forward(const MatrixXd &batchInput) {
+        forward(batchInput, nullptr);
+        return layers.back().output;
+    }
+
+    // One SGD step on batch; returns the loss before the step.
+    double trainBatch(const MatrixXd &batchInput, const MatrixXd &batchTarget,
+                      double lr) {
+        const int threads = pool.size();
+        losses.assign(threads, 0.0);
+        forward(batchInput, &batchTarget);
+        std::vector<Index> columns = split(batchInput.cols(), threads);
+        for (int l = layers.size() - 1; l >= 0; l--) {
+            pool.run([&](int t) { backwardShard(l, t, batchInput, lr); });
+            if (l > 0 && layers[l].axis == ShardAxis::COLUMNS) {
+                pool.run([&](int t) {
+                    reduceError(l, columns[t], columns[t + 1]);
+                });
+            }
+        }
+        double loss = 0.0;
+        for (double l : losses) {
+            loss += l;
+        }
+        return loss / batchTarget.size();
+    }
+
+    // Samples per second of training steps at each hidden width, for the
+    // network's single-threaded Eigen GEMM path and for tensor-parallel
+    // copies on 1, 2, 4, ... maxThreads threads, with speedup over Eigen.
+    static void compareScaling(const std::vector<int> &widths, int batchSize,
+                               int maxThreads, int steps = 10,
+                               double lr = 0.003) {
+        typedef std::chrono::steady_clock Clock;
+        std::vector<int> counts;
+        for (int threads = 1; threads < maxThreads; threads *= 2) {
+            counts.push_back(threads);
+        }
+        counts.push_back(std::max(1, maxThreads));
+
+        std::cout << "\n===== TENSOR-PARALLEL SCALING (784-W-W-10, batch "
+                  << batchSize << ", " << steps << " steps, "
+                  << std::thread::hardware_concurrency()
+                  << " hardware threads) =====\n";
+        MatrixXd input = MatrixXd::Random(784, batchSize).cwiseAbs();
+        MatrixXd target = MatrixXd::Zero(10, batchSize);
+        for (int i = 0; i < batchSize; i++) {
+            target(i % 10, i) = 1.0;
+        }
+        for (int width : widths) {
+            Network network(784, width, ActivationType::RELU);
+            network.addLayer(width, ActivationType::RELU);
+            network.addLayer(10, ActivationType::SOFTMAX);
+            network.setSparseInputThreshold(0.0);
+            network.setGradientClipping(0.0, false);
+            std::vector<double> initial = network.snapshotParameters();
+            SGD sgd(lr, 0.0);
+
+            network.trainBatch(input, target, sgd);
+            auto start = Clock::now();
+            for (int s = 0; s < steps; s++) {
+                network.trainBatch(input, target, sgd);
+            }
+            double seconds =
+                std::chrono::duration<double>(Clock::now() - start).count();
+            double baseline = steps * batchSize / seconds;
+            network.restoreParameters(initial);
+            std::cout << "W = " << width << ": Eigen GEMM, 1 thread "
+                      << std::fixed << std::setprecision(0) << baseline
+                      << " samples/s\n";
+
+            for (int threads : counts) {
+                TensorParallelNetwork parallel(network, threads);
+                parallel.trainBatch(input, target, lr);
+                start = Clock::now();
+                for (int s = 0; s < steps; s++) {
+                    parallel.trainBatch(input, target, lr);
+                }
+                seconds = std::chrono::duration<double>(Clock::now() - start)
+                              .count();
+                double samplesPerSecond = steps * batchSize / seconds;
+                std::cout << std::setw(12) << threads
+                          << " threads: " << std::setprecision(0)
+                          << samplesPerSecond << " samples/s, speedup "
+                          << std::setprecision(2)
+                          << samplesPerSecond / baseline << "x, efficiency "
+                          << std::setprecision(1)
+                          << samplesPerSecond / baseline / threads * 100.0
+                          << "%\n";
+            }
+        }
+        std::cout << "====================================================="
+                     "=====\n\n";
+    }
+};